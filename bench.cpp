@@ -0,0 +1,405 @@
+#include "include/slog.h"
+#include "include/escape.h"
+#include "include/lz.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// producer latency distribution, end-to-end drain and disk rate per queue mode,
+// overflow policy, message shape and thread count; see usage()
+
+namespace{
+    typedef std::chrono::steady_clock Clock;
+
+    // log-linear buckets: each power of two split into 16, within ~6% of the true value
+    class Histogram{
+    public:
+        void add(uint64_t ns){
+            counts[index(ns)]++;
+            total++;
+            sum += ns;
+            max_ns = std::max(max_ns, ns);
+        }
+
+        void merge(const Histogram& other){
+            for(size_t i = 0; i < counts.size(); i++)   counts[i] += other.counts[i];
+            total += other.total;
+            sum += other.sum;
+            max_ns = std::max(max_ns, other.max_ns);
+        }
+
+        uint64_t percentile(double p) const{
+            const uint64_t rank = static_cast<uint64_t>(p / 100 * total);
+            uint64_t seen = 0;
+            for(size_t i = 0; i < counts.size(); i++){
+                seen += counts[i];
+                if(seen > rank) return std::min(upper(i), max_ns);
+            }
+            return max_ns;
+        }
+
+        uint64_t max() const{return max_ns;}
+        double mean() const{return total == 0 ? 0 : static_cast<double>(sum) / total;}
+
+    private:
+        static constexpr const int sub_bits = 4;
+        std::array<uint64_t, 64 << sub_bits>counts{};
+        uint64_t total = 0;
+        uint64_t sum = 0;
+        uint64_t max_ns = 0;
+
+        static size_t index(uint64_t ns){
+            if(ns < (1u << sub_bits))   return ns;
+            const int top = 63 - __builtin_clzll(ns);
+            const int shift = top - sub_bits;
+            return ((top - sub_bits + 1) << sub_bits) + ((ns >> shift) & ((1u << sub_bits) - 1));
+        }
+
+        static uint64_t upper(size_t i){
+            if(i < (1u << sub_bits))    return i;
+            const int shift = static_cast<int>(i >> sub_bits) - 1;
+            const uint64_t low = ((1u << sub_bits) + (i & ((1u << sub_bits) - 1))) << shift;
+            return low + (uint64_t(1) << shift) - 1;
+        }
+    };
+
+    struct Shape{
+        const char* name;
+        void (*log)(int i);
+    };
+
+    void small_stream(int i){
+        LOG_INFO << "request " << i << " done";
+    }
+
+    void small_format(int i){
+        SLOGF(slog::LogSeverity::INFO, "request {} done", i);
+    }
+
+    void many_args(int i){
+        SLOGF(slog::LogSeverity::INFO, "a={} b={} c={} d={} e={} f={} g={} h={}",
+            i, static_cast<int64_t>(i) * 3, -99.876, 'x', "name", static_cast<uint64_t>(i), -i, 0.25);
+    }
+
+    void long_string(int i){
+        static const std::string payload(512, 'x');
+        LOG_INFO << "payload " << i << " " << payload;
+    }
+
+    void oversized(int i){
+        // one record in 16384 over a quarter of the default byte ring; the dropped column shows any lost
+        static const std::string payload(3 << 20, 'x');
+        if(i % 16384 == 0)  LOG_INFO << "oversized " << i << " " << payload;
+        else    SLOGF(slog::LogSeverity::INFO, "request {} done", i);
+    }
+
+    const Shape shapes[] = {
+        {"small", small_stream},
+        {"small_f", small_format},
+        {"many_args", many_args},
+        {"long_string", long_string},
+        {"oversized", oversized},
+    };
+
+    struct Mode{
+        const char* name;
+        slog::QueueMode mode;
+    };
+
+    const Mode modes[] = {
+        {"shared", slog::QueueMode::SHARED},
+        {"per_thread", slog::QueueMode::PER_THREAD},
+        {"byte_ring", slog::QueueMode::BYTE_RING},
+    };
+
+    struct Policy{
+        const char* name;
+        slog::OverflowPolicy policy;
+    };
+
+    const Policy policies[] = {
+        {"block", slog::OverflowPolicy::BLOCK},
+        {"drop_newest", slog::OverflowPolicy::DROP_NEWEST},
+    };
+
+    struct Options{
+        uint32_t records = 200000;     // per run, split across the producer threads
+        std::vector<uint32_t>threads;
+        std::vector<uint32_t>workers{0, 2};   // Config::format_workers
+        uint32_t compress = 0;     // Config::compress_level of the runs
+        std::string dir = "/tmp/slog_bench/";
+        FILE* json = nullptr;
+    };
+
+    uint64_t disk_bytes(const std::string& dir, const std::string& name){
+        uint64_t bytes = 0;
+        std::error_code ec;
+        for(const auto& entry : std::filesystem::directory_iterator(dir, ec)){
+            if(entry.path().filename().string().compare(0, name.size() + 1, name + ".") == 0)  bytes += entry.file_size(ec);
+        }
+        return bytes;
+    }
+
+    void remove_logs(const std::string& dir, const std::string& name){
+        std::error_code ec;
+        for(const auto& entry : std::filesystem::directory_iterator(dir, ec)){
+            if(entry.path().filename().string().compare(0, name.size() + 1, name + ".") == 0)  std::filesystem::remove(entry.path(), ec);
+        }
+    }
+
+    void run(const Options& options, const Mode& mode, const Policy& policy, const Shape& shape, uint32_t threads, uint32_t workers){
+        static int runs = 0;
+        const std::string name = "bench" + std::to_string(runs++);
+        slog::Config config;
+        config.dir = options.dir;
+        config.name = name;
+        config.roll_size = 64;
+        config.queue_mode = mode.mode;
+        config.overflow = policy.policy;
+        config.format_workers = workers;
+        config.compress_level = options.compress;
+        slog::init(config);
+        const uint64_t dropped_before = slog::get_dropped_count();
+        const uint64_t formatted_before = slog::stats().bytes_written;
+
+        const uint32_t per_thread = std::max(1u, options.records / threads);
+        std::vector<Histogram>histograms(threads);
+        std::atomic<uint32_t>ready{0};
+        std::atomic<bool>go{false};
+        std::vector<std::thread>producers;
+        for(uint32_t t = 0; t < threads; t++){
+            producers.emplace_back([&, t]{
+                Histogram& histogram = histograms[t];
+                ready.fetch_add(1);
+                while(!go.load(std::memory_order_acquire))  std::this_thread::yield();
+                for(uint32_t i = 0; i < per_thread; i++){
+                    const auto begin = Clock::now();
+                    shape.log(static_cast<int>(i));
+                    histogram.add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count());
+                }
+            });
+        }
+        while(ready.load() != threads)  std::this_thread::yield();
+        const auto begin = Clock::now();
+        go.store(true, std::memory_order_release);
+        for(std::thread& producer : producers)  producer.join();
+        const auto produced = Clock::now();
+        slog::flush();
+        const auto drained = Clock::now();
+
+        Histogram all;
+        for(const Histogram& histogram : histograms)    all.merge(histogram);
+        const uint64_t records = static_cast<uint64_t>(per_thread) * threads;
+        const uint64_t dropped = slog::get_dropped_count() - dropped_before;
+        const uint64_t bytes = disk_bytes(options.dir, name);
+        const double ratio = bytes == 0 ? 0 : static_cast<double>(slog::stats().bytes_written - formatted_before) / bytes;
+        const double produce_secs = std::chrono::duration<double>(produced - begin).count();
+        const double total_secs = std::chrono::duration<double>(drained - begin).count();
+        const double records_per_sec = (records - dropped) / total_secs;
+        const double bytes_per_sec = bytes / total_secs;
+
+        printf("%-10s %-11s %-11s %3u %3u %7lu %7lu %8lu %9lu %9.0f %9.0f %9.1f %5.1f %8lu\n",
+            mode.name, policy.name, shape.name, threads, workers,
+            (unsigned long)all.percentile(50), (unsigned long)all.percentile(99), (unsigned long)all.percentile(99.9), (unsigned long)all.max(),
+            records / produce_secs / 1e3, records_per_sec / 1e3, bytes_per_sec / 1e6, ratio, (unsigned long)dropped);
+        fflush(stdout);
+        if(options.json != nullptr){
+            fprintf(options.json, "{\"bench\":\"latency\",\"mode\":\"%s\",\"overflow\":\"%s\",\"shape\":\"%s\",\"threads\":%u,\"workers\":%u,"
+                "\"records\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu,\"mean_ns\":%.1f,"
+                "\"produce_records_per_s\":%.0f,\"drain_records_per_s\":%.0f,\"disk_bytes_per_s\":%.0f,\"disk_bytes\":%lu,"
+                "\"compress_level\":%u,\"compression_ratio\":%.2f,\"dropped\":%lu}\n",
+                mode.name, policy.name, shape.name, threads, workers, (unsigned long)records,
+                (unsigned long)all.percentile(50), (unsigned long)all.percentile(99), (unsigned long)all.percentile(99.9), (unsigned long)all.max(), all.mean(),
+                records / produce_secs, records_per_sec, bytes_per_sec, (unsigned long)bytes, options.compress, ratio, (unsigned long)dropped);
+            fflush(options.json);
+        }
+        // the files stay open until the next init replaces this logger, unlinking them is fine
+        remove_logs(options.dir, name);
+    }
+
+    void bench_format(const Options& options){
+        // formatting stage alone: one record formatted repeatedly into a reused buffer
+        const int rounds = 1000000;
+        static const slog::CallSite site(__FILE__, __func__, __LINE__, slog::LogSeverity::INFO, false);
+        slog::LogLine line(&site);
+        line << "Logging-" << 123456 << "-double-" << -99.876 << "-uint64-" << (uint64_t)123456;
+        slog::ByteBuffer out(1 << 20);
+        size_t bytes = 0;
+        auto begin = Clock::now();
+        for(int i = 0; i < rounds; i++){
+            if(out.size() > (1 << 19)){
+                bytes += out.size();
+                out.clear();
+            }
+            line.format(out);
+        }
+        auto end = Clock::now();
+        bytes += out.size();
+        const double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+        printf("format: %.1f ns/line %.1f MB/s\n\n", ns / rounds, bytes / ns * 1e3);
+        if(options.json != nullptr){
+            fprintf(options.json, "{\"bench\":\"format\",\"ns_per_record\":%.1f,\"bytes_per_s\":%.0f}\n", ns / rounds, bytes / ns * 1e9);
+        }
+    }
+
+    void bench_escape(const Options& options){
+        // JSON string escaping alone, the vector kernel against the byte loop, on
+        // clean text and on text with a quote or newline every ~40 bytes
+        struct Input{
+            const char* name;
+            std::string text;
+        };
+        std::vector<Input>inputs;
+        for(size_t len : {16, 64, 512, 4096}){
+            std::string clean, dirty;
+            for(size_t i = 0; i < len; i++){
+                clean.push_back(static_cast<char>('a' + i % 26));
+                dirty.push_back(i % 40 == 39 ? (i % 80 == 79 ? '\n' : '"') : static_cast<char>('a' + i % 26));
+            }
+            inputs.push_back(Input{"clean", clean});
+            inputs.push_back(Input{"dirty", dirty});
+        }
+        slog::ByteBuffer out(1 << 16);
+        printf("escape kernel: %s\n", slog::escape_kernel());
+        for(const Input& input : inputs){
+            for(int vector = 1; vector >= 0; vector--){
+                const size_t rounds = (64u << 20) / input.text.size();
+                const auto begin = Clock::now();
+                for(size_t i = 0; i < rounds; i++){
+                    out.clear();
+                    if(vector)  slog::escape_json(out, input.text.data(), input.text.size());
+                    else    slog::escape_json_scalar(out, input.text.data(), input.text.size());
+                }
+                const double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+                const char* kernel = vector ? slog::escape_kernel() : "scalar";
+                printf("escape %-6s %-5s %5zu B: %8.1f ns/string %6.2f GB/s\n",
+                    kernel, input.name, input.text.size(), ns / rounds, input.text.size() * rounds / ns);
+                if(options.json != nullptr){
+                    fprintf(options.json, "{\"bench\":\"escape\",\"kernel\":\"%s\",\"input\":\"%s\",\"bytes\":%zu,\"ns_per_string\":%.1f,\"bytes_per_s\":%.0f}\n",
+                        kernel, input.name, input.text.size(), ns / rounds, input.text.size() * rounds / ns * 1e9);
+                }
+            }
+        }
+        printf("\n");
+    }
+
+    void bench_compress(const Options& options){
+        // the block codec alone, on ~8 MB of TEXT lines cut into Config::compress_block_kb
+        // blocks: ratio, compression and decompression rate per level
+        static const slog::CallSite site(__FILE__, __func__, __LINE__, slog::LogSeverity::INFO, false);
+        static const char* const users[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi"};
+        slog::ByteBuffer text(9 << 20);
+        for(int i = 0; text.size() < (8u << 20); i++){
+            slog::LogLine line(&site);
+            line << "request " << i << " served in " << (i * 7919 % 1000) << " us user=" << users[i % 8]
+                << " path=/api/v1/items/" << (i % 97) << " status=" << (i % 50 == 0 ? 500 : 200);
+            line.format(text);
+        }
+        const size_t block = 256 << 10;
+        std::vector<char>packed(slog::lz_bound(block));
+        std::vector<char>raw(block);
+        for(int level : {1, 3, 6, 9}){
+            size_t bytes = 0;
+            const auto begin = Clock::now();
+            for(size_t at = 0; at < text.size(); at += block){
+                bytes += slog::lz_compress(text.data() + at, std::min(block, text.size() - at), packed.data(), level);
+            }
+            const double compress_ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+            double decompress_ns = 0;
+            for(size_t at = 0; at < text.size(); at += block){
+                const size_t n = std::min(block, text.size() - at);
+                const size_t m = slog::lz_compress(text.data() + at, n, packed.data(), level);
+                const auto start = Clock::now();
+                const bool ok = slog::lz_decompress(packed.data(), m, raw.data(), n);
+                decompress_ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+                if(!ok || memcmp(raw.data(), text.data() + at, n) != 0){
+                    fprintf(stderr, "lz level %d: block at %zu does not round-trip\n", level, at);
+                    return;
+                }
+            }
+            const double ratio = static_cast<double>(text.size()) / bytes;
+            printf("lz level %d: ratio %5.2f, compress %7.1f MB/s, decompress %7.1f MB/s\n",
+                level, ratio, text.size() / compress_ns * 1e3, text.size() / decompress_ns * 1e3);
+            if(options.json != nullptr){
+                fprintf(options.json, "{\"bench\":\"lz\",\"level\":%d,\"bytes\":%zu,\"ratio\":%.2f,\"compress_bytes_per_s\":%.0f,\"decompress_bytes_per_s\":%.0f}\n",
+                    level, text.size(), ratio, text.size() / compress_ns * 1e9, text.size() / decompress_ns * 1e9);
+            }
+        }
+        printf("\n");
+    }
+
+    std::vector<uint32_t>default_threads(){
+        // powers of two up to the core count, and the core count itself
+        const uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<uint32_t>threads;
+        for(uint32_t n = 1; n < cores; n *= 2) threads.push_back(n);
+        threads.push_back(cores);
+        return threads;
+    }
+
+    void usage(const char* argv0){
+        fprintf(stderr, "usage: %s [--records N] [--threads 1,2,4] [--workers 0,2] [--compress LEVEL] [--dir DIR] [--json FILE]\n"
+            "  runs every queue mode x overflow policy x message shape x thread count x format workers,\n"
+            "  writing compressed files with --compress; ratio is formatted bytes over bytes on disk,\n"
+            "  --json appends one JSON object per result line to FILE\n", argv0);
+    }
+}
+
+int main(int argc, char** argv){
+    Options options;
+    for(int i = 1; i < argc; i++){
+        const bool has_value = i + 1 < argc;
+        if(strcmp(argv[i], "--records") == 0 && has_value){
+            options.records = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }else if(strcmp(argv[i], "--threads") == 0 && has_value){
+            std::stringstream list(argv[++i]);
+            for(std::string n; std::getline(list, n, ',');)    options.threads.push_back(std::max(1ul, std::strtoul(n.c_str(), nullptr, 10)));
+        }else if(strcmp(argv[i], "--workers") == 0 && has_value){
+            std::stringstream list(argv[++i]);
+            options.workers.clear();
+            for(std::string n; std::getline(list, n, ',');)    options.workers.push_back(std::strtoul(n.c_str(), nullptr, 10));
+        }else if(strcmp(argv[i], "--compress") == 0 && has_value){
+            options.compress = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        }else if(strcmp(argv[i], "--dir") == 0 && has_value){
+            options.dir = argv[++i];
+            if(options.dir.back() != '/')   options.dir += '/';
+        }else if(strcmp(argv[i], "--json") == 0 && has_value){
+            options.json = fopen(argv[++i], "a");
+            if(options.json == nullptr){
+                fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+                return 2;
+            }
+        }else{
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if(options.threads.empty()) options.threads = default_threads();
+    std::filesystem::create_directories(options.dir);
+
+    bench_format(options);
+    bench_escape(options);
+    bench_compress(options);
+    printf("%-10s %-11s %-11s %3s %3s %7s %7s %8s %9s %9s %9s %9s %5s %8s\n",
+        "mode", "overflow", "shape", "thr", "wrk", "p50 ns", "p99 ns", "p99.9 ns", "max ns", "prod k/s", "drain k/s", "disk MB/s", "ratio", "dropped");
+    for(const Mode& mode : modes){
+        for(const Policy& policy : policies){
+            for(const Shape& shape : shapes){
+                for(uint32_t threads : options.threads){
+                    for(uint32_t workers : options.workers) run(options, mode, policy, shape, threads, workers);
+                }
+            }
+        }
+    }
+    if(options.json != nullptr) fclose(options.json);
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef SLOG_BYTE_BUFFER_H
+#define SLOG_BYTE_BUFFER_H
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+namespace slog{
+    // growable output buffer, reused across records so formatting never allocates once warm
+    class ByteBuffer{
+    public:
+        explicit ByteBuffer(size_t capacity = 4096)
+          : storage(new char[capacity]), used(0), cap(capacity){}
+
+        char* reserve(size_t n){
+            if(used + n > cap)  grow(used + n);
+            return storage.get() + used;
+        }   // room for n more bytes, publish them with commit
+
+        void commit(size_t n) noexcept{used += n;}
+
+        void append(const char* data, size_t n){
+            memcpy(reserve(n), data, n);
+            used += n;
+        }
+
+        void push_back(char c){
+            *reserve(1) = c;
+            ++used;
+        }
+
+        const char* data() const noexcept{return storage.get();}
+        char* data() noexcept{return storage.get();}
+        size_t size() const noexcept{return used;}
+        size_t capacity() const noexcept{return cap;}
+        void clear() noexcept{used = 0;}
+        void truncate(size_t n) noexcept{if(n < used) used = n;}
+
+        void swap(ByteBuffer& other) noexcept{
+            storage.swap(other.storage);
+            std::swap(used, other.used);
+            std::swap(cap, other.cap);
+        }   // hands a filled buffer to another thread without a copy
+
+        ByteBuffer(const ByteBuffer&) = delete;
+        ByteBuffer& operator=(const ByteBuffer&) = delete;
+
+    private:
+        std::unique_ptr<char[]>storage;
+        size_t used;
+        size_t cap;
+
+        void grow(size_t need){
+            size_t next = cap * 2;
+            if(next < need) next = need;
+            std::unique_ptr<char[]>bigger(new char[next]);
+            memcpy(bigger.get(), storage.get(), used);
+            storage.swap(bigger);
+            cap = next;
+        }
+    };
+}
+
+#endif // SLOG_BYTE_BUFFER_H
@@ -0,0 +1,52 @@
+#ifndef SLOG_CALL_SITE_H
+#define SLOG_CALL_SITE_H
+#include "severity.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+namespace slog{
+    // constant metadata of one logging statement, a function-local static
+    // created by SLOG on first use; records only carry a pointer to it
+    class CallSite{
+    public:
+        CallSite(const char* file, const char* func, uint32_t line, LogSeverity level, bool registered = true);
+        // SLOGF: records hold untagged arguments of arg_types, spliced into format
+        CallSite(const char* file, const char* func, uint32_t line, LogSeverity level,
+            const char* format, const uint8_t* arg_types, uint8_t arg_count, bool registered = true);
+
+        const char* file() const noexcept{return file_;}
+        const char* func() const noexcept{return func_;}
+        uint32_t line() const noexcept{return line_;}
+        LogSeverity level() const noexcept{return level_;}
+        uint32_t id() const noexcept{return id_;}  // registration order, UINT32_MAX if not registered
+        const char* format() const noexcept{return format_;}  // nullptr for streamed statements
+        const uint8_t* arg_types() const noexcept{return arg_types_;}  // LogLine::DataTypes indices
+        uint8_t arg_count() const noexcept{return arg_count_;}
+
+        bool enabled() const noexcept{return enabled_.load(std::memory_order_relaxed);}
+        void set_enabled(bool on) noexcept{enabled_.store(on, std::memory_order_relaxed);}
+
+        CallSite(const CallSite&) = delete;
+        CallSite& operator=(const CallSite&) = delete;
+
+    private:
+        friend void for_each_call_site(const std::function<void(CallSite&)>& fn);
+
+        const char* const file_;
+        const char* const func_;
+        const uint32_t line_;
+        const LogSeverity level_;
+        const char* const format_;
+        const uint8_t* const arg_types_;
+        const uint8_t arg_count_;
+        uint32_t id_;
+        std::atomic<bool> enabled_{true};
+        CallSite* next = nullptr;   // registry list, newest first
+    };
+
+    // visits every call site reached so far, e.g. to toggle them by file
+    void for_each_call_site(const std::function<void(CallSite&)>& fn);
+}
+
+#endif // SLOG_CALL_SITE_H
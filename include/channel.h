@@ -0,0 +1,57 @@
+#ifndef SLOG_CHANNEL_H
+#define SLOG_CHANNEL_H
+#include "severity.h"
+#include "config.h"
+#include "stats.h"
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace slog{
+    class Logger;
+    Stats stats();
+
+    // an independent logger with its own queue, consumer thread, files and
+    // level, picked at the call site with SLOG_TO / SLOGF_TO. Handles from
+    // channel() stay valid for the life of the process; init() may replace
+    // the logger behind one while other threads log to it. Records go to the
+    // new logger at once, and it opens its files only after the old one is
+    // drained and closed, numbering on from the old files when dir and name
+    // are the same. Loggers are drained and closed at exit.
+    class Channel{
+    public:
+        const std::string& name() const noexcept{return name_;}
+
+        bool is_logged(LogSeverity level) const;
+        void set_level(LogSeverity level){threshold -> store(level, std::memory_order_relaxed);}
+        LogSeverity level() const{return threshold -> load(std::memory_order_relaxed);}
+
+        void init(const Config& config);    // starts the logger, or replaces it
+        void flush();
+        bool flush(std::chrono::milliseconds timeout);
+        uint64_t dropped() const;
+
+        Channel(const Channel&) = delete;
+        Channel& operator=(const Channel&) = delete;
+
+    private:
+        friend struct Slog;
+        friend Channel& channel(const std::string& name);
+        friend Stats stats();
+        friend void drain_channels(int sig);
+
+        Channel(const std::string& name, std::atomic<LogSeverity>* threshold);
+
+        const std::string name_;
+        std::atomic<LogSeverity> own_threshold{LogSeverity::DEBUG};
+        std::atomic<LogSeverity>* const threshold;  // the default channel shares slog::log_level
+        std::atomic<Logger*> logger{nullptr};
+        Channel* next = nullptr;    // every channel, newest first, never unlinked
+    };
+
+    // "" is the default channel behind SLOG, SLOGF, LOG_* and slog::init;
+    // others are created on first lookup and drop records until init()
+    Channel& channel(const std::string& name);
+}
+
+#endif // SLOG_CHANNEL_H
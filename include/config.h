@@ -0,0 +1,194 @@
+#ifndef SLOG_CONFIG_H
+#define SLOG_CONFIG_H
+#include "flags.h"
+#include "sink.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace slog{
+    /*
+     * How a thread waits when it has nothing to do: the consumer when the
+     * queue is empty, a producer when the queue has no room.
+     *
+     * SPIN     busy-polls with a pause hint. Lowest latency (tens of ns),
+     *          but the waiting thread burns a full core even when idle.
+     * YIELD    spins briefly, then sched_yield()s. Latency stays in the
+     *          microsecond range; an idle consumer still shows as 100% CPU
+     *          on an otherwise idle core, but gives way to runnable threads.
+     * BACKOFF  spins, yields, then sleeps with naps doubling up to
+     *          max_backoff_us. Near-zero idle CPU; the first record after an
+     *          idle period may wait up to max_backoff_us to be picked up.
+     * BLOCK    spins briefly, then parks on a condition variable. Zero idle
+     *          CPU; the waking side pays one notify (a futex syscall) per
+     *          park, not per record, and a lost race is bounded by
+     *          park_timeout_us.
+     */
+    enum class WaitStrategy : uint8_t {
+        SPIN,
+        YIELD,
+        BACKOFF,
+        BLOCK
+    };
+
+    /*
+     * What a producer does when every pooled buffer is queued and none has
+     * been drained yet.
+     *
+     * BLOCK             wait (with producer_wait) for the consumer to free one.
+     * DROP_NEWEST       discard the record and count it, see get_dropped_count.
+     * OVERWRITE_OLDEST  discard the oldest unread buffer and reuse it, keeping
+     *                   the most recent records. Needs at least 3 buffers,
+     *                   otherwise behaves as BLOCK.
+     */
+    enum class OverflowPolicy : uint8_t {
+        BLOCK,
+        DROP_NEWEST,
+        OVERWRITE_OLDEST
+    };
+
+    /*
+     * SHARED      one queue of pooled buffers shared by every producer, records
+     *             are kept in push order.
+     * PER_THREAD  each producer thread gets its own wait-free SPSC ring on its
+     *             first record; the consumer merges the ring heads by
+     *             timestamp. Removes producer contention at the cost of
+     *             thread_ring_size records of memory per logging thread.
+     * BYTE_RING   one shared ring of byte_ring_kb bytes holding each record
+     *             contiguously with a 16-byte header, so a record costs its
+     *             encoded size instead of a 256-byte slot and long records
+     *             rarely touch the heap. SLOGF encodes straight into the ring.
+     *             A record over a quarter of the ring goes to the heap with
+     *             only its address in the ring, and is not recovered after a
+     *             crash. Every record under OVERWRITE_OLDEST is dropped once
+     *             the ring is full.
+     *             With ring_file set the ring lives in that file (e.g. under
+     *             /dev/shm) along with a table of call sites, and records stay
+     *             in it until their bytes reach the log file. After a crash the
+     *             next init with the same ring_file appends what was committed
+     *             but never written, or decode it with slog_decode -r. A
+     *             ring_file another live logger holds is left alone, and the
+     *             ring then stays in memory.
+     */
+    enum class QueueMode : uint8_t {
+        SHARED,
+        PER_THREAD,
+        BYTE_RING
+    };
+
+    /*
+     * TEXT    formatted lines in path.N.txt, kv() fields as key=value.
+     * BINARY  records as encoded by LogLine in path.N.slog, with file and
+     *         function names interned into a per-file string table. No
+     *         formatting on the consumer; convert with slog_decode.
+     * JSON    one object per line in path.N.jsonl: ts, level, thread, file,
+     *         func, line, msg, then each kv() field as a member of its own,
+     *         numbers unquoted.
+     * LOGFMT  the same keys as key=value pairs in path.N.logfmt, values
+     *         quoted when they hold spaces, '=', quotes or control bytes.
+     * JSON and LOGFMT times are ISO8601 at time_precision, and sinks get
+     * lines in the same layout; with BINARY they get TEXT lines.
+     */
+    enum class OutputFormat : uint8_t {
+        TEXT,
+        BINARY,
+        JSON,
+        LOGFMT
+    };
+
+    /*
+     * Timestamp of TEXT lines.
+     *
+     * COMPACT  [2024-3-9-154507, fields unpadded; the subsecond digits follow
+     *          a '-', gmt_offset appends +seconds and dst appends -DST0/1.
+     * ISO8601  [2024-03-09T15:45:07], zero padded; the subsecond digits follow
+     *          a '.', gmt_offset appends +hh:mm, dst is not shown.
+     */
+    enum class TimeLayout : uint8_t {
+        COMPACT,
+        ISO8601
+    };
+
+    // digits after the second: none, 3, 6 or 9
+    enum class TimePrecision : uint8_t {
+        SECONDS,
+        MILLISECONDS,
+        MICROSECONDS,
+        NANOSECONDS
+    };
+
+    /*
+     * WRITE  buffered bytes go out with write(2), one call per write_buffer_kb.
+     * MMAP   each file is created at roll_size and mapped, buffered bytes are
+     *        copied into the mapping without a syscall. Every msync_interval_ms
+     *        the pages written so far are msync'ed (MS_ASYNC) and dropped from
+     *        the process; the file is truncated to its length when it rolls.
+     *        Bytes copied in survive a crash of the process, not of the host.
+     */
+    enum class FileSink : uint8_t {
+        WRITE,
+        MMAP
+    };
+
+    /*
+     * Rolls to the next file at the top of each local hour or at local
+     * midnight, in addition to the roll_size limit. Checked against record
+     * timestamps, so an idle logger opens the new file with its next record.
+     */
+    enum class RollInterval : uint8_t {
+        NONE,
+        HOURLY,
+        DAILY
+    };
+
+    struct Config{
+        std::string dir = FLAG_LOG_DIR;
+        std::string name = FLAG_LOG_NAME;
+        uint32_t roll_size = 8;     // MB per file, also preallocated ahead of each roll
+        RollInterval roll_interval = RollInterval::NONE;
+        uint32_t write_buffer_kb = 1024;    // formatted bytes buffered per write(2)
+        uint32_t flush_interval_ms = 100;   // upper bound on how long buffered bytes wait when idle
+        OutputFormat format = OutputFormat::TEXT;
+        FileSink sink = FileSink::WRITE;
+        uint32_t msync_interval_ms = 1000;  // MMAP only
+        bool index = false;     // path.N.idx beside each file but BINARY ones, for slog_query
+        uint32_t index_block_kb = 64;   // log bytes per index entry
+        uint32_t compress_level = 0;    // 1 (fastest) to 9: path.N.<ext>.lz in blocks, see lz.h; not with MMAP
+        uint32_t compress_block_kb = 256;   // log bytes per compressed block
+        uint32_t recompress_level = 0;  // rolled files rewritten at this level in the background, plain ones too
+
+        TimeLayout time_layout = TimeLayout::COMPACT;   // TEXT only, as is dst
+        TimePrecision time_precision = TimePrecision::SECONDS;
+        bool gmt_offset = false;
+        bool dst = false;
+
+        LogSeverity file_level = LogSeverity::DEBUG;    // lower records only reach the sinks
+        std::vector<std::shared_ptr<Sink>>sinks;    // lines in the file's layout, TEXT when it is BINARY
+        uint32_t sink_queue_kb = 1024;  // per sink, lines that do not fit are dropped
+
+        WaitStrategy consumer_wait = WaitStrategy::BACKOFF;
+        WaitStrategy producer_wait = WaitStrategy::YIELD;
+        uint32_t max_backoff_us = 1000;
+        uint32_t park_timeout_us = 50000;
+
+        uint32_t max_buffers = 4;   // pooled and pre-faulted at init, ~8.5 MB each
+        OverflowPolicy overflow = OverflowPolicy::BLOCK;
+
+        QueueMode queue_mode = QueueMode::SHARED;
+        uint32_t thread_ring_size = 4096;   // records per producer thread, PER_THREAD only
+        uint32_t byte_ring_kb = 8192;   // rounded up to a power of two, BYTE_RING only
+        std::string ring_file;  // file-backed ring, BYTE_RING only
+
+        uint32_t fatal_flush_timeout_ms = 1000; // slog::abort and fatal signals wait this long for the consumer
+        bool handle_fatal_signals = false;  // SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT: log, drain, then the handler installed before
+        uint32_t stats_interval_ms = 0;     // the consumer logs slog::stats() this often, 0 = never
+
+        // lines are formatted by this many threads in batches, the consumer
+        // still writes them in queue order; 0 formats on the consumer. BINARY
+        // ignores it, its string table is built as records are written.
+        uint32_t format_workers = 0;
+    };
+}
+
+#endif // SLOG_CONFIG_H
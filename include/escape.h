@@ -0,0 +1,15 @@
+#ifndef SLOG_ESCAPE_H
+#define SLOG_ESCAPE_H
+#include "byte_buffer.h"
+#include <cstddef>
+
+namespace slog{
+    // appends s as the inside of a JSON string: '"', '\\' and bytes below 0x20
+    // escaped, everything else, UTF-8 included, copied as it is. Runs of clean
+    // bytes are found 32 or 16 at a time with AVX2 or SSE2 when the CPU has them
+    void escape_json(ByteBuffer& out, const char* s, size_t n);
+    void escape_json_scalar(ByteBuffer& out, const char* s, size_t n);  // byte at a time, same output
+    const char* escape_kernel();    // "avx2", "sse2" or "scalar", picked once at startup
+}
+
+#endif // SLOG_ESCAPE_H
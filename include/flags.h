@@ -1,7 +1,6 @@
-#define FLAG_GMT_OFFSET false
-#define FLAG_IS_DST false
-#define FLAG_DEFAULT_ISO_8601_TIME true
-#define FLAG_DEFAULT_WITH_MILLISEC false
-#define ENABLE_CONSOLE_OUT false
 #define FLAG_LOG_DIR "/tmp/"
 #define FLAG_LOG_NAME "log"
+
+#ifndef FLAG_MIN_LOG_LEVEL
+#define FLAG_MIN_LOG_LEVEL 0    // 0 DEBUG .. 4 FATAL, lower levels are compiled out
+#endif
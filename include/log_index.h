@@ -0,0 +1,63 @@
+#ifndef SLOG_LOG_INDEX_H
+#define SLOG_LOG_INDEX_H
+#include <cstdint>
+#include <cstring>
+
+namespace slog{
+    /*
+     * The path.N.idx sidecar written next to each TEXT, JSON or LOGFMT file
+     * with Config::index: an IndexHeader, then one IndexBlock per
+     * index_block_kb of log, appended as each block closes. Blocks start and
+     * end on line boundaries. Bytes after the last block (the open one, or
+     * what a crashed process wrote) are not indexed, readers scan them.
+     */
+    struct IndexHeader{
+        char magic[8];          // "SLOGIDX"
+        uint32_t version;
+        uint8_t format;         // OutputFormat
+        uint8_t time_layout;    // TimeLayout
+        uint16_t reserved;
+    };
+
+    struct IndexBlock{
+        uint64_t offset;        // in the log file
+        uint64_t bytes;
+        uint64_t min_ts;        // ns since epoch; lines need not be in time order
+        uint64_t max_ts;
+        uint32_t lines;
+        uint32_t levels;        // bit 1 << LogSeverity for each level present
+        uint64_t sites[8];      // bloom filter of index_site_key(file, line)
+    };
+
+    constexpr const char index_magic[8] = {'S', 'L', 'O', 'G', 'I', 'D', 'X', '\0'};
+    constexpr const uint32_t index_version = 1;
+
+    // FNV-1a of the file's base name and the line, so "main.cpp:42" finds a site
+    // whatever path __FILE__ carried
+    inline uint64_t index_site_key(const char* file, uint32_t line){
+        const char* slash = strrchr(file, '/');
+        const char* name = slash != nullptr ? slash + 1 : file;
+        uint64_t hash = 14695981039346656037ull;
+        for(; *name != '\0'; name++)    hash = (hash ^ static_cast<uint8_t>(*name)) * 1099511628211ull;
+        for(int i = 0; i < 4; i++)  hash = (hash ^ ((line >> (8 * i)) & 0xff)) * 1099511628211ull;
+        return hash;
+    }
+
+    // three probes into 512 bits, from independent slices of the key
+    inline void index_bloom_add(uint64_t (&bits)[8], uint64_t key){
+        for(int i = 0; i < 3; i++){
+            const uint32_t bit = (key >> (i * 9)) & 511;
+            bits[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+
+    inline bool index_bloom_test(const uint64_t (&bits)[8], uint64_t key){
+        for(int i = 0; i < 3; i++){
+            const uint32_t bit = (key >> (i * 9)) & 511;
+            if((bits[bit >> 6] & (uint64_t(1) << (bit & 63))) == 0)    return false;
+        }
+        return true;
+    }
+}
+
+#endif // SLOG_LOG_INDEX_H
@@ -1,15 +1,28 @@
 #ifndef SLOGTIME_H
 #define SLOGTIME_H
 #include <chrono>
+#include <cstdint>
+#include <ctime>
 
 namespace slogtime{
+    typedef uint64_t timestamp_t;   // nanoseconds since epoch
+
+    inline timestamp_t now() noexcept{
+        return static_cast<timestamp_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+    }   // producer side: a single clock read, no calendar conversion
+
     class LogLineTime{
     public:
         LogLineTime();
-        explicit LogLineTime(std::chrono::system_clock::time_point now);
-        const std::chrono::system_clock::time_point& when() const noexcept{return timestamp;}
+        explicit LogLineTime(timestamp_t ts);
+        std::chrono::system_clock::time_point when() const noexcept{
+            return std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(timestamp)));
+        }
+        timestamp_t raw() const noexcept{return timestamp;}
         int sec() const noexcept{return tm_.tm_sec;}
-        int usec() const noexcept{return usecs.count();}
+        int usec() const noexcept{return static_cast<int>(timestamp % 1000000000 / 1000);}
         int min() const noexcept{return tm_.tm_min;}
         int hour() const noexcept{return tm_.tm_hour;}
         int day() const noexcept{return tm_.tm_mday;}
@@ -18,13 +31,11 @@ namespace slogtime{
         int dayOfWeek() const noexcept{return tm_.tm_wday;}
         int dayInYear() const noexcept{return tm_.tm_yday;}
         int dst() const noexcept{return tm_.tm_isdst;}
-        std::chrono::seconds gmtoffset() const noexcept{return gmtoffset_;}
+        std::chrono::seconds gmtoffset() const noexcept{return std::chrono::seconds(tm_.tm_gmtoff);}
         const std::tm& tm() const noexcept{return tm_;}
     private:
-        std::tm tm_{};  // time of creation of LogLine
-        std::chrono::system_clock::time_point timestamp;
-        std::chrono::microseconds usecs;
-        std::chrono::seconds gmtoffset_;
+        std::tm tm_{};  // calendar time, converted on the consumer side
+        timestamp_t timestamp;
     };
 }
 
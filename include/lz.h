@@ -0,0 +1,46 @@
+#ifndef SLOG_LZ_H
+#define SLOG_LZ_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace slog{
+    /*
+     * A file written with Config::compress_level, path.N.<ext>.lz: an
+     * LzFileHeader, then blocks of at most compress_block_kb of log, each an
+     * LzBlock and its payload and each decompressible on its own. Blocks of
+     * TEXT, JSON and LOGFMT end on line boundaries, and raw_offset is where
+     * the block starts in the uncompressed log, the offsets a path.N.idx
+     * sidecar uses. The payload is an LZ77 stream in the LZ4 block layout
+     * (token of literal and match lengths, literals, 16-bit offset), or the
+     * bytes themselves when that is not smaller. A torn last block, from a
+     * crash, is one whose payload runs past the end of the file.
+     */
+    struct LzFileHeader{
+        char magic[8];          // "SLOGLZ"
+        uint32_t version;
+        uint8_t format;         // OutputFormat
+        uint8_t reserved[3];
+    };
+
+    struct LzBlock{
+        uint64_t raw_offset;
+        uint32_t raw_bytes;
+        uint32_t packed_bytes;  // of payload, lz_stored set when it is the raw bytes
+    };
+
+    constexpr const char lz_magic[8] = {'S', 'L', 'O', 'G', 'L', 'Z', '\0', '\0'};
+    constexpr const uint32_t lz_version = 1;
+    constexpr const uint32_t lz_stored = 0x80000000u;
+
+    size_t lz_bound(size_t n);  // room lz_compress may need for n bytes
+    // level 1 (one hash probe per position) to 9 (a deep match search, for
+    // recompressing rolled files); the payload size, never more than lz_bound(n)
+    size_t lz_compress(const char* in, size_t n, char* out, int level);
+    bool lz_decompress(const char* in, size_t n, char* out, size_t raw);   // false unless exactly raw bytes come out
+    bool lz_unpack(const LzBlock& block, const char* payload, char* out);   // raw_bytes into out, stored or compressed
+    // every complete block of a .lz file in order, false if path is not one
+    bool lz_read_file(const std::string& path, std::string& out);
+}
+
+#endif // SLOG_LZ_H
@@ -0,0 +1,103 @@
+#ifndef SLOG_RATE_LIMIT_H
+#define SLOG_RATE_LIMIT_H
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace slog{
+    class CallSite;
+
+    // per-call-site admission state for the LOG_EVERY_N family; admit() sets
+    // skipped to the lines suppressed since the last admitted one. A suppressed
+    // line costs one relaxed atomic op (EVERY_T also reads the clock).
+    class EveryN{
+    public:
+        explicit EveryN(uint64_t n) : n(n == 0 ? 1 : n){}
+
+        bool admit(uint64_t& skipped){
+            const uint64_t seen = count.fetch_add(1, std::memory_order_relaxed);
+            if(seen % n != 0)   return false;
+            skipped = seen == 0 ? 0 : n - 1;
+            return true;
+        }
+
+    private:
+        const uint64_t n;
+        std::atomic<uint64_t>count{0};
+    };
+
+    class FirstN{
+    public:
+        explicit FirstN(uint64_t n) : n(n){}
+
+        bool admit(uint64_t&){
+            if(count.load(std::memory_order_relaxed) >= n)  return false;
+            return count.fetch_add(1, std::memory_order_relaxed) < n;
+        }
+
+    private:
+        const uint64_t n;
+        std::atomic<uint64_t>count{0};
+    };
+
+    class EveryT{
+    public:
+        template<typename Rep, typename Period>
+        explicit EveryT(std::chrono::duration<Rep, Period> period)
+          : period(std::chrono::duration_cast<std::chrono::nanoseconds>(period).count()){}
+
+        bool admit(uint64_t& skipped){
+            const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+            int64_t due = next.load(std::memory_order_relaxed);
+            // of the threads that find the period over, one moves it on and logs
+            if(now < due || !next.compare_exchange_strong(due, now + period, std::memory_order_relaxed)){
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            skipped = suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+
+    private:
+        const int64_t period;
+        std::atomic<int64_t>next{0};
+        std::atomic<uint64_t>suppressed{0};
+    };
+
+    class Sampled{
+    public:
+        // p in [0, 1]
+        explicit Sampled(double p)
+          : threshold(p >= 1 ? UINT64_MAX : p <= 0 ? 0 : static_cast<uint64_t>(p * 18446744073709551616.0)){}
+
+        bool admit(uint64_t& skipped){
+            if(threshold != UINT64_MAX && next_random() >= threshold){
+                suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            skipped = suppressed.exchange(0, std::memory_order_relaxed);
+            return true;
+        }
+
+    private:
+        const uint64_t threshold;
+        std::atomic<uint64_t>suppressed{0};
+
+        static uint64_t next_random(){
+            // xorshift64*, one state per thread shared by every sampled site
+            static thread_local uint64_t state = reinterpret_cast<uintptr_t>(&state) | 1;
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1DULL;
+        }
+    };
+
+    struct Admitted{
+        const CallSite* site;   // nullptr when the line is filtered or suppressed
+        uint64_t skipped;
+    };
+}
+
+#endif // SLOG_RATE_LIMIT_H
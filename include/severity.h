@@ -6,10 +6,10 @@ namespace slog{
     enum class LogSeverity : uint8_t { 
         DEBUG, 
         INFO, 
-        ERROR, 
         WARN, 
+        ERROR, 
         FATAL 
-    };
+    };  // ordered by severity, filtering keeps levels >= threshold
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,62 @@
+#ifndef SLOG_SINK_H
+#define SLOG_SINK_H
+#include "severity.h"
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace slog{
+    /*
+     * An extra destination for formatted lines, next to the log file. The
+     * consumer formats each record once; every sink whose level admits it gets
+     * a copy through its own bounded queue and thread, so a slow sink drops
+     * lines (Stats::sink_dropped) instead of holding up the file or other sinks.
+     * write() and flush() are only called from that thread; a sink shared by
+     * several loggers is called from each of their threads.
+     */
+    class Sink{
+    public:
+        explicit Sink(LogSeverity level = LogSeverity::DEBUG) : level_(level){}
+        virtual ~Sink() = default;
+
+        // one line, '\n' included; the bytes are only valid during the call
+        virtual void write(const char* line, size_t bytes, LogSeverity level) = 0;
+        virtual void flush(){}  // after each batch of lines taken off the queue
+
+        LogSeverity level() const noexcept{return level_;}
+
+    private:
+        const LogSeverity level_;
+    };
+
+    // stdout or another descriptor, the level tag colored per severity
+    class ConsoleSink : public Sink{
+    public:
+        explicit ConsoleSink(LogSeverity level = LogSeverity::DEBUG, int fd = 1);
+        void write(const char* line, size_t bytes, LogSeverity level) override;
+        void flush() override;
+
+    private:
+        const int fd;
+        std::string pending;
+    };
+
+    // keeps the last capacity lines in memory, e.g. for tests to inspect
+    class MemorySink : public Sink{
+    public:
+        explicit MemorySink(size_t capacity = 1024, LogSeverity level = LogSeverity::DEBUG);
+        void write(const char* line, size_t bytes, LogSeverity level) override;
+
+        std::vector<std::string>lines() const;  // oldest first, without the '\n'
+        void clear();
+
+    private:
+        const size_t capacity;
+        mutable std::mutex mutex;
+        std::deque<std::string>kept;
+    };
+}
+
+#endif // SLOG_SINK_H
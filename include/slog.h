@@ -1,16 +1,45 @@
 #include "severity.h"
 #include "log_time.h"
 #include "flags.h"
+#include "config.h"
+#include "byte_buffer.h"
+#include "call_site.h"
+#include "stats.h"
+#include "rate_limit.h"
+#include "channel.h"
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <memory>
 #include <thread>
 #include <tuple>
+#include <string_view>
+#include <type_traits>
 
 namespace slog{
+    class Logger;
+    class BinaryEncoder;
+    class LineFormatter;
+
+    // a named field, << slog::kv("user", id): key=value in TEXT lines, a typed
+    // member of its own in JSON and LOGFMT ones
+    template<typename T>
+    struct KeyValue{
+        const char* key;
+        const T& value;
+    };
+
+    template<typename T>
+    KeyValue<T> kv(const char* key, const T& value){
+        return KeyValue<T>{key, value};
+    }
+
     class LogLine{
     public:
-        LogLine(LogSeverity level, char const* file, char const* func, uint32_t line);
+        explicit LogLine(const CallSite* site);    // records time and thread, the rest comes from site
         ~LogLine();
 
         LogLine(LogLine&&) = default;
@@ -45,21 +74,46 @@ namespace slog{
 	        return *this;
 	    }
 
+        template<typename T>
+        LogLine& operator<<(const KeyValue<T>& field){
+            encode_field(field.key, field.key != nullptr ? strlen(field.key) : 0);
+            return *this << field.value;
+        }
+
         struct string_literal_t{
             const char* s;
             explicit string_literal_t(const char* s) : s(s){}
         };
 
+        struct field_t{};   // a kv() key, stored NUL-terminated like char*, ahead of its value
+
+        // encoded argument types, a record stores the tuple index before each payload
+        typedef std::tuple<char, char*, int32_t, int64_t, uint32_t, uint64_t, double, LogLine::string_literal_t, LogLine::field_t> DataTypes;
+
+        LogLine& suppressed(uint64_t count){
+            return count == 0 ? *this : *this << "(suppressed " << count << ") ";
+        }   // rate-limited call sites note the lines dropped since the last one
+
         void stream_to_string(std::ostream& s);
+        void format(ByteBuffer& out);   // appends the text line in the default layout, '\n' included
+        size_t size() const{return used_bytes;}   // encoded bytes, header included
+        slogtime::timestamp_t timestamp() const;
+        const CallSite* site() const;
+        LogSeverity level() const;
 
     private:
+        friend class Logger;
+        friend class BinaryEncoder;
+        friend class LineFormatter;
+        friend class BufferBase;
+        friend struct Slog;
+        friend bool decode_binary(std::istream& in, std::ostream& out);
+
         size_t used_bytes;
         size_t buffer_size;
         std::unique_ptr<char[]> heap_buffer;
         char stack_buffer[256 - 2 * sizeof(size_t) - sizeof(decltype(heap_buffer)) - 8];
 
-        typedef std::tuple<char, char*, int32_t, int64_t, uint32_t, uint64_t, double, LogLine::string_literal_t> DataTypes;
-        
         char* buffer();
 
         template<typename T>
@@ -71,17 +125,68 @@ namespace slog{
         void encode(string_literal_t arg);
 
         void encode_string(const char* arg, size_t len);
+        void encode_field(const char* key, size_t len);
+
+        static constexpr size_t header_size = sizeof(slogtime::timestamp_t) + sizeof(std::thread::id) + sizeof(const CallSite*);
+        static char* encode_header(char* b, const CallSite* site);  // time, thread, call site
 
         void resize_buffer(size_t bytes);
 
-        void stream_to_string(std::ostream& s, char* start, const char* const end);
     };
 
+    // one statement's hold on a channel's logger, which init() cannot free
+    // before the Slog is gone; a channel without a logger drops the record
     struct Slog{
+        Slog();     // the default channel
+        explicit Slog(Channel& channel);
+        ~Slog();
+
         bool operator+=(LogLine& logline);
+
+        // SLOGF: arguments without type tags, in the order of the call site's
+        // arg_types, encoded straight into queue memory sized up front
+        template<typename... Args>
+        bool emit(const CallSite* site, const Args&... args);
+
+        Slog(const Slog&) = delete;
+        Slog& operator=(const Slog&) = delete;
+
+    private:
+        Logger* const logger;
+
+        char* reserve(size_t bytes);    // nullptr if the record is dropped
+        void commit(char* record);
     };
     
     void init(const std::string& dir, const std::string name, uint32_t roll_size);
+    void init(const Config& config);
+    void flush();   // blocks until records logged so far by this thread are written to the file and the sinks
+    bool flush(std::chrono::milliseconds timeout);  // false if they were not written in time
+    // drains for at most Config::fatal_flush_timeout_ms, then std::abort()
+    [[noreturn]] void abort();
+
+    // converts an OutputFormat::BINARY log file back to the text layout
+    bool decode_binary(std::istream& in, std::ostream& out);
+    // formats the records a crashed process left in a Config::ring_file, false if there are none
+    bool decode_ring(const std::string& path, std::ostream& out);
+
+    constexpr LogSeverity min_log_level = static_cast<LogSeverity>(FLAG_MIN_LOG_LEVEL);
+    extern std::atomic<LogSeverity> log_level;    // runtime threshold, see set_log_level
+
+    void set_log_level(LogSeverity level);
+    LogSeverity get_log_level();
+    const char* level_to_string(LogSeverity level);   // "Debug" .. "Fatal", as lines carry them
+    uint64_t get_dropped_count();     // records discarded by OverflowPolicy
+    Stats stats();
+
+    inline bool is_logged(LogSeverity level){
+        // the compile-time half folds away for constant levels, the runtime half is one relaxed load
+        return level >= min_log_level && level >= log_level.load(std::memory_order_relaxed);
+    }
+
+    inline bool Channel::is_logged(LogSeverity level) const{
+        return level >= min_log_level && level >= threshold -> load(std::memory_order_relaxed);
+    }
 
 }
 
@@ -122,7 +227,191 @@ namespace{
 
 }
 
-#define SLOG(LEVEL) slog::Slog() += slog::LogLine(LEVEL, __FILE__, __func__, __LINE__)
+namespace slog{
+    // SLOGF argument types, each maps to a DataTypes index; strings are stored NUL-terminated
+    template<typename T, typename = void>
+    struct FormatArg{
+        static_assert(sizeof(T) == 0, "SLOGF: unsupported argument type");
+    };
+
+    template<typename T, uint8_t Id>
+    struct FixedFormatArg{
+        static constexpr uint8_t id = Id;
+        static constexpr size_t fixed = sizeof(T);
+        static size_t size(T) noexcept{return 0;}
+        static char* put(char* b, T arg) noexcept{
+            memcpy(b, &arg, sizeof(T));
+            return b + sizeof(T);
+        }
+    };
+
+    template<>
+    struct FormatArg<char> : FixedFormatArg<char, TupleIndexHelper<char, LogLine::DataTypes>::value>{};
+
+    template<typename T>
+    struct FormatArg<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, char>::value
+        && !std::is_same<T, bool>::value>::type>{
+        typedef typename std::conditional<std::is_signed<T>::value,
+            typename std::conditional<sizeof(T) <= 4, int32_t, int64_t>::type,
+            typename std::conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type>::type stored;
+        static constexpr uint8_t id = TupleIndexHelper<stored, LogLine::DataTypes>::value;
+        static constexpr size_t fixed = sizeof(stored);
+        static size_t size(T) noexcept{return 0;}
+        static char* put(char* b, T arg) noexcept{
+            return FixedFormatArg<stored, id>::put(b, static_cast<stored>(arg));
+        }
+    };
+
+    template<typename T>
+    struct FormatArg<T, typename std::enable_if<std::is_floating_point<T>::value>::type>{
+        static constexpr uint8_t id = TupleIndexHelper<double, LogLine::DataTypes>::value;
+        static constexpr size_t fixed = sizeof(double);
+        static size_t size(T) noexcept{return 0;}
+        static char* put(char* b, T arg) noexcept{
+            return FixedFormatArg<double, id>::put(b, static_cast<double>(arg));
+        }
+    };
+
+    struct StringFormatArg{
+        static constexpr uint8_t id = TupleIndexHelper<char*, LogLine::DataTypes>::value;
+        static constexpr size_t fixed = 1;  // the NUL
+        static size_t size(std::string_view arg) noexcept{return arg.size();}
+        static char* put(char* b, std::string_view arg) noexcept{
+            memcpy(b, arg.data(), arg.size());
+            b[arg.size()] = '\0';
+            return b + arg.size() + 1;
+        }
+    };
+
+    template<>
+    struct FormatArg<std::string> : StringFormatArg{};
+
+    template<>
+    struct FormatArg<std::string_view> : StringFormatArg{};
+
+    template<typename T>
+    struct FormatArg<T*, typename std::enable_if<std::is_same<typename std::remove_const<T>::type, char>::value>::type>{
+        static constexpr uint8_t id = StringFormatArg::id;
+        static constexpr size_t fixed = 1;
+        static size_t size(const char* arg) noexcept{return arg == nullptr ? 0 : strlen(arg);}
+        static char* put(char* b, const char* arg) noexcept{
+            return StringFormatArg::put(b, arg == nullptr ? std::string_view() : std::string_view(arg));
+        }
+    };
+
+    template<typename Tuple>
+    struct FormatArgs;
+
+    template<typename... Args>
+    struct FormatArgs<std::tuple<Args...>>{
+        static_assert(sizeof...(Args) < 256, "SLOGF: too many arguments");
+        static constexpr uint8_t count = sizeof...(Args);
+        static constexpr std::array<uint8_t, sizeof...(Args)> ids{{FormatArg<typename std::decay<Args>::type>::id...}};
+    };
+
+    // number of {} in fmt, {{ and }} being literal braces; -1 for a stray brace
+    constexpr int count_placeholders(const char* fmt){
+        int count = 0;
+        for(; *fmt != '\0'; fmt++){
+            if(fmt[0] == '{' && fmt[1] == '}'){
+                count++;
+                fmt++;
+            }else if((fmt[0] == '{' && fmt[1] == '{') || (fmt[0] == '}' && fmt[1] == '}')){
+                fmt++;
+            }else if(fmt[0] == '{' || fmt[0] == '}'){
+                return -1;
+            }
+        }
+        return count;
+    }
+
+    inline char* LogLine::encode_header(char* b, const CallSite* site){
+        const slogtime::timestamp_t ts = slogtime::now();
+        const std::thread::id tid = this_thread_id();
+        memcpy(b, &ts, sizeof(ts));
+        memcpy(b + sizeof(ts), &tid, sizeof(tid));
+        memcpy(b + sizeof(ts) + sizeof(tid), &site, sizeof(site));
+        return b + header_size;
+    }
+
+    template<typename... Args>
+    bool Slog::emit(const CallSite* site, const Args&... args){
+        constexpr size_t fixed = LogLine::header_size + (static_cast<size_t>(0) + ... + FormatArg<typename std::decay<Args>::type>::fixed);
+        const size_t bytes = fixed + (static_cast<size_t>(0) + ... + FormatArg<typename std::decay<Args>::type>::size(args));
+        char* const record = reserve(bytes);
+        if(record == nullptr)   return false;
+        char* b = LogLine::encode_header(record, site);
+        ((b = FormatArg<typename std::decay<Args>::type>::put(b, args)), ...);
+        commit(record);
+        return true;
+    }
+}
+
+// one static CallSite per statement, constructed and registered on first use;
+// __func__ is passed in since inside the lambda it would name the lambda
+#define SLOG_CALL_SITE(LEVEL) \
+    [](const char* func) -> const slog::CallSite* { \
+        static slog::CallSite site(__FILE__, func, __LINE__, LEVEL); \
+        return site.enabled() ? &site : nullptr; \
+    }(__func__)
+
+// the streamed arguments form the loop body, which runs once at most, so a
+// filtered or disabled statement never constructs the LogLine nor evaluates
+// them; unlike an if, the loop cannot capture a following else
+#define SLOG(LEVEL) \
+    for(const slog::CallSite* slog_site_ = slog::is_logged(LEVEL) ? SLOG_CALL_SITE(LEVEL) : nullptr; \
+        slog_site_ != nullptr; slog_site_ = nullptr) \
+        slog::Slog() += slog::LogLine(slog_site_)
+// the argument types come in as a pointer to a tuple type, so the lambda
+// itself needs no access to the caller's variables
+#define SLOGF_CALL_SITE(LEVEL, FMT, ...) \
+    [](const char* func, auto* args) -> const slog::CallSite* { \
+        typedef slog::FormatArgs<typename std::remove_pointer<decltype(args)>::type> Args; \
+        static_assert(slog::count_placeholders(FMT) >= 0, "SLOGF: stray '{' or '}' in format string"); \
+        static_assert(slog::count_placeholders(FMT) == Args::count, "SLOGF: placeholder count does not match arguments"); \
+        static slog::CallSite site(__FILE__, func, __LINE__, LEVEL, FMT, Args::ids.data(), Args::count); \
+        return site.enabled() ? &site : nullptr; \
+    }(__func__, static_cast<decltype(std::forward_as_tuple(__VA_ARGS__))*>(nullptr))
+
+// SLOGF(level, "x={} y={}", x, y): the format string is checked against the
+// arguments at compile time and kept in the call site, records carry only
+// the argument bytes; the void cast rejects a trailing << chain
+#define SLOGF(LEVEL, FMT, ...) \
+    for(const slog::CallSite* slog_site_ = slog::is_logged(LEVEL) ? SLOGF_CALL_SITE(LEVEL, FMT, __VA_ARGS__) : nullptr; \
+        slog_site_ != nullptr; slog_site_ = nullptr) \
+        (void)slog::Slog().emit(slog_site_, ##__VA_ARGS__)
+
+// SLOG / SLOGF into a channel other than the default one, CHANNEL being a
+// slog::Channel&, e.g. static slog::Channel& net = slog::channel("net");
+#define SLOG_TO(CHANNEL, LEVEL) \
+    for(const slog::CallSite* slog_site_ = (CHANNEL).is_logged(LEVEL) ? SLOG_CALL_SITE(LEVEL) : nullptr; \
+        slog_site_ != nullptr; slog_site_ = nullptr) \
+        slog::Slog(CHANNEL) += slog::LogLine(slog_site_)
+
+#define SLOGF_TO(CHANNEL, LEVEL, FMT, ...) \
+    for(const slog::CallSite* slog_site_ = (CHANNEL).is_logged(LEVEL) ? SLOGF_CALL_SITE(LEVEL, FMT, __VA_ARGS__) : nullptr; \
+        slog_site_ != nullptr; slog_site_ = nullptr) \
+        (void)slog::Slog(CHANNEL).emit(slog_site_, ##__VA_ARGS__)
+
+// SLOG behind a per-call-site LIMITER constructed once from ARG; a line it
+// suppresses never builds a LogLine nor evaluates its arguments
+#define SLOG_LIMITED(LEVEL, LIMITER, ARG) \
+    for(slog::Admitted slog_admit_ = slog::is_logged(LEVEL) ? \
+            [](const char* func, const auto& arg) -> slog::Admitted { \
+                static slog::CallSite site(__FILE__, func, __LINE__, LEVEL); \
+                static LIMITER limiter(arg); \
+                uint64_t skipped = 0; \
+                if(!site.enabled() || !limiter.admit(skipped))  return slog::Admitted{nullptr, 0}; \
+                return slog::Admitted{&site, skipped}; \
+            }(__func__, ARG) : slog::Admitted{nullptr, 0}; \
+        slog_admit_.site != nullptr; slog_admit_.site = nullptr) \
+        slog::Slog() += slog::LogLine(slog_admit_.site).suppressed(slog_admit_.skipped)
+
+#define LOG_EVERY_N(LEVEL, N) SLOG_LIMITED(LEVEL, slog::EveryN, N)      // the 1st, N+1th, 2N+1th ... line
+#define LOG_FIRST_N(LEVEL, N) SLOG_LIMITED(LEVEL, slog::FirstN, N)
+#define LOG_EVERY_T(LEVEL, PERIOD) SLOG_LIMITED(LEVEL, slog::EveryT, PERIOD)    // a std::chrono duration
+#define LOG_SAMPLED(LEVEL, P) SLOG_LIMITED(LEVEL, slog::Sampled, P)     // each line with probability P
+
 #define LOG_DEBUG SLOG(slog::LogSeverity::DEBUG)
 #define LOG_INFO SLOG(slog::LogSeverity::INFO)
 #define LOG_ERROR SLOG(slog::LogSeverity::ERROR)
@@ -137,7 +426,7 @@ namespace{
 #define CHECK_F(condition) \
     if (!(condition)){ \
         LOG_WARN << "CHECK failed: " << #condition; \
-        std::abort(); \
+        slog::abort(); \
     }
 
 #define CHECK_EQ(a, b) \
@@ -148,7 +437,7 @@ namespace{
 #define CHECK_EQ_F(a, b) \
     if ((a) != (b)){ \
         LOG_FATAL<< "CHECK_EQ failed: " << #a << " != " << #b; \
-        std::abort(); \
+        slog::abort(); \
     }
 
 #define CHECK_STREQ(str1, str2) \
@@ -159,7 +448,7 @@ namespace{
 #define CHECK_STREQ_F(str1, str2) \
     if (strcmp(str1, str2) != 0) { \
         LOG_FATAL << "CHECK_STREQ failed: \"" << str1 << "\" != \"" << str2 << "\""; \
-        std::abort(); \
+        slog::abort(); \
     }
 
 #define CHECK_STREQ_CASE(str1, str2) \
@@ -170,7 +459,7 @@ namespace{
 #define CHECK_STREQ_CASE_F(str1, str2) \
     if (!strcasecmp(str1, str2)) { \
         LOG_WARN << "CHECK_STREQ_CASE_F failed: \"" << str1 << "\" != \"" << str2 << "\""; \
-        std::abort(); \
+        slog::abort(); \
     }
 
 #define CHECK_P(ptr) \
@@ -181,7 +470,7 @@ namespace{
 #define CHECK_P_F(ptr) \
     if ((ptr) == nullptr){ \
         LOG_FATAL<< "CHECK_P failed: pointer " << #ptr << " is null"; \
-        std::abort(); \
+        slog::abort(); \
     }
 
 #define CHECK_T(v, type) \
@@ -0,0 +1,25 @@
+#ifndef SLOG_STATS_H
+#define SLOG_STATS_H
+#include <cstdint>
+
+namespace slog{
+    // pipeline counters since the process started, across every init();
+    // producer counters are summed over per-thread shards when read
+    struct Stats{
+        uint64_t enqueued = 0;          // records the queue accepted
+        uint64_t dropped = 0;           // discarded by OverflowPolicy
+        uint64_t written = 0;           // records handed to the file by the consumer
+        uint64_t bytes_written = 0;     // formatted or binary bytes
+        uint64_t compressed_bytes = 0;  // what Config::compress_level wrote for them, headers included
+        uint64_t queue_depth = 0;       // enqueued but not yet popped, now
+        uint64_t queue_depth_max = 0;   // high-water mark, sampled by the consumer
+        uint64_t producer_stalls = 0;   // times a producer waited for room in a full queue
+        uint64_t producer_stall_ns = 0;
+        uint64_t rolls = 0;
+        uint64_t roll_ns = 0;           // consumer time spent switching files
+        uint64_t heap_allocations = 0;  // records that outgrew LogLine's inline buffer
+        uint64_t sink_dropped = 0;      // lines a Sink's queue had no room for
+    };
+}
+
+#endif // SLOG_STATS_H
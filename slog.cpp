@@ -1,24 +1,45 @@
 #include "include/slog.h"
 #include "include/colors.h"
+#include "include/escape.h"
+#include "include/log_index.h"
+#include "include/lz.h"
 #include <string.h>
-#include <queue>
+#include <deque>
+#include <vector>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <typeinfo>
+#include <charconv>
+#include <cmath>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <iterator>
 #include <chrono>
 #include <ctime>
 #include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <signal.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace slogtime{
-    LogLineTime::LogLineTime() : LogLineTime(std::chrono::system_clock::now()) {}
+    LogLineTime::LogLineTime() : LogLineTime(now()) {}
 
-    LogLineTime::LogLineTime(std::chrono::system_clock::time_point now) : timestamp(now) {
-        time_t tt = std::chrono::system_clock::to_time_t(now);
-        gmtoffset_ = std::chrono::seconds(std::localtime(&tt)->tm_gmtoff);
-        std::tm* ptm = std::localtime(&tt);
-        tm_ = *ptm;
-        usecs = std::chrono::duration_cast<std::chrono::microseconds>(now - std::chrono::system_clock::from_time_t(tt));
+    LogLineTime::LogLineTime(timestamp_t ts) : timestamp(ts) {
+        time_t tt = static_cast<time_t>(ts / 1000000000);
+        localtime_r(&tt, &tm_);    // reentrant, no shared static tm
     }
 }
 
@@ -59,6 +80,80 @@ namespace slog{
         return "";
     }
 
+    namespace{
+        // producer counters, sharded by thread so logging threads rarely share a line
+        struct alignas(64) StatShard{
+            std::atomic<uint64_t>enqueued{0};
+            std::atomic<uint64_t>stalls{0};
+            std::atomic<uint64_t>stall_ns{0};
+            std::atomic<uint64_t>heap_allocations{0};
+        };
+        constexpr const size_t stat_shard_count = 32;
+        StatShard stat_shards[stat_shard_count];
+
+        StatShard& stat_shard(){
+            static std::atomic<uint32_t>next{0};
+            static thread_local StatShard& shard = stat_shards[next.fetch_add(1, std::memory_order_relaxed) % stat_shard_count];
+            return shard;
+        }
+
+        void count(std::atomic<uint64_t>& counter, uint64_t n = 1){
+            counter.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // consumer counters; two consumers overlap while init() replaces a logger
+        struct ConsumerStats{
+            std::atomic<uint64_t>popped{0};
+            std::atomic<uint64_t>written{0};
+            std::atomic<uint64_t>bytes{0};
+            std::atomic<uint64_t>compressed{0};
+            std::atomic<uint64_t>depth_max{0};
+            std::atomic<uint64_t>rolls{0};
+            std::atomic<uint64_t>roll_ns{0};
+            std::atomic<uint64_t>retired_dropped{0};    // by loggers already replaced
+            std::atomic<uint64_t>overwritten{0};        // enqueued, then discarded by OVERWRITE_OLDEST
+            std::atomic<uint64_t>sink_dropped{0};
+        } consumer_stats;
+
+        // dropped and overwritten by the current logger, which keeps its own drop counts
+        Stats collect_stats(uint64_t dropped, uint64_t overwritten){
+            Stats stats;
+            for(const StatShard& shard : stat_shards){
+                stats.enqueued += shard.enqueued.load(std::memory_order_relaxed);
+                stats.producer_stalls += shard.stalls.load(std::memory_order_relaxed);
+                stats.producer_stall_ns += shard.stall_ns.load(std::memory_order_relaxed);
+                stats.heap_allocations += shard.heap_allocations.load(std::memory_order_relaxed);
+            }
+            stats.dropped = consumer_stats.retired_dropped.load(std::memory_order_relaxed) + dropped;
+            stats.written = consumer_stats.written.load(std::memory_order_relaxed);
+            stats.bytes_written = consumer_stats.bytes.load(std::memory_order_relaxed);
+            stats.compressed_bytes = consumer_stats.compressed.load(std::memory_order_relaxed);
+            stats.rolls = consumer_stats.rolls.load(std::memory_order_relaxed);
+            stats.roll_ns = consumer_stats.roll_ns.load(std::memory_order_relaxed);
+            stats.sink_dropped = consumer_stats.sink_dropped.load(std::memory_order_relaxed);
+            // a producer counts its record after the push, so the consumer may be ahead for a moment
+            const uint64_t gone = consumer_stats.popped.load(std::memory_order_relaxed)
+                + consumer_stats.overwritten.load(std::memory_order_relaxed) + overwritten;
+            stats.queue_depth = stats.enqueued > gone ? stats.enqueued - gone : 0;
+            stats.queue_depth_max = std::max(stats.queue_depth, consumer_stats.depth_max.load(std::memory_order_relaxed));
+            return stats;
+        }
+
+        // times a producer's wait for room in a full queue
+        class Stall{
+        public:
+            Stall() : begin(std::chrono::steady_clock::now()){}
+            ~Stall(){
+                StatShard& shard = stat_shard();
+                count(shard.stalls);
+                count(shard.stall_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+            }
+
+        private:
+            const std::chrono::steady_clock::time_point begin;
+        };
+    }
+
     char* LogLine::buffer(){
         return !heap_buffer ? &stack_buffer[used_bytes] : &(heap_buffer.get())[used_bytes];
     }
@@ -66,6 +161,7 @@ namespace slog{
     void LogLine::resize_buffer(size_t bytes){
         const size_t new_size = used_bytes + bytes;
         if(new_size <= buffer_size) return;
+        count(stat_shard().heap_allocations);
         if(!heap_buffer){
             buffer_size = std::max(static_cast<size_t>(512), new_size);
             heap_buffer.reset(new char[buffer_size]);
@@ -88,59 +184,142 @@ namespace slog{
         used_bytes += len + 2;
     }
 
-    #if (ENABLE_CONSOLE_OUT == false)
+    void LogLine::encode_field(const char* key, size_t len){
+        // an empty key is kept, the value after it is still this field's
+        resize_buffer(len + 2);
+        char* b = buffer();
+        *reinterpret_cast<uint8_t*>(b++) = static_cast<uint8_t>(TupleIndexHelper<field_t, DataTypes>::value);
+        memcpy(b, key != nullptr ? key : "", len);
+        b[len] = '\0';
+        used_bytes += len + 2;
+    }
+
     template<typename T>
-    char* decode(std::ostream& s, char* data, T* dummy){
-        T arg = *reinterpret_cast<T*>(data);
-        s << arg;
-        return data + sizeof(T);
+    void put_integer(ByteBuffer& out, T arg){
+        char* b = out.reserve(24);
+        out.commit(std::to_chars(b, b + 24, arg).ptr - b);
     }
 
+    typedef LogLine::DataTypes DataTypes;
+
+    struct StringArg{
+        const char* s;
+        size_t len;
+    };  // char* payload, NUL-terminated in the record
+
+    template<typename T>
+    struct ArgCodec{
+        static T read(const char*& data){
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type arg;
+            memcpy(&arg, data, sizeof(T));
+            data += sizeof(T);
+            return *reinterpret_cast<T*>(&arg);
+        }
+    };
+
     template<>
-    char* decode(std::ostream& s, char* data, LogLine::string_literal_t* dummy){
-        LogLine::string_literal_t sliteral = *reinterpret_cast<LogLine::string_literal_t*>(data);
-        s << sliteral.s;
-        return data + sizeof(LogLine::string_literal_t);
-    }
+    struct ArgCodec<char*>{
+        static StringArg read(const char*& data){
+            StringArg arg{data, strlen(data)};
+            data += arg.len + 1;
+            return arg;
+        }
+    };
+
+    struct FieldArg{
+        const char* s;
+        size_t len;
+    };  // field_t payload, the key of the argument that follows
 
     template<>
-    char* decode(std::ostream& s, char* data, char** dummy){
-        while(*data != '\0'){
-            s << *data;
-            ++data;
+    struct ArgCodec<LogLine::field_t>{
+        static FieldArg read(const char*& data){
+            FieldArg arg{data, strlen(data)};
+            data += arg.len + 1;
+            return arg;
         }
-        return ++data;
+    };
+
+    template<typename Visitor, typename T>
+    const char* visit_arg(Visitor& visitor, const char* data){
+        visitor(ArgCodec<T>::read(data));
+        return data;
     }
-    #endif
 
-    #if (ENABLE_CONSOLE_OUT == true)
-    template<typename T>
-    char* decode(std::ostream& s, char* data, T dummy){
-        T arg = *reinterpret_cast<T*>(data);
-        s << arg;
-        std::cout << arg;
-        return data + sizeof(T);
+    template<typename Visitor, size_t... I>
+    constexpr std::array<const char* (*)(Visitor&, const char*), sizeof...(I)> make_visit_table(std::index_sequence<I...>){
+        return {{&visit_arg<Visitor, typename std::tuple_element<I, DataTypes>::type>...}};
     }
 
-    template<>
-    char* decode(std::ostream& s, char* data, LogLine::string_literal_t* dummy){
-        LogLine::string_literal_t sliteral = *reinterpret_cast<LogLine::string_literal_t*>(data);
-        s << sliteral.s;
-        std::cout << sliteral.s;
-        return data + sizeof(LogLine::string_literal_t);
+    // one entry per DataTypes index, so a new type only needs an ArgCodec (if it is
+    // not fixed-size) and an overload in each visitor, which fails to compile otherwise
+    template<typename Visitor>
+    void visit_args(Visitor& visitor, const char* data, const char* const end){
+        static constexpr auto table = make_visit_table<Visitor>(std::make_index_sequence<std::tuple_size<DataTypes>::value>());
+        while(data < end){
+            const uint8_t id = static_cast<uint8_t>(*data++);
+            if(id >= table.size())  return;
+            data = table[id](visitor, data);
+        }
     }
 
-    template<>
-    char* decode(std::ostream& s, char* data, char** dummy){
-        while(*data != '\0'){
-            s << *data;
-            std::cout << *data;
-            ++data;
+    struct TextArgs{
+        ByteBuffer& out;
+        const size_t begin = out.size();
+
+        void operator()(FieldArg key){
+            if(out.size() != begin && out.data()[out.size() - 1] != ' ')  out.push_back(' ');
+            out.append(key.s, key.len);
+            out.push_back('=');
         }
-        data++;
-        return data;
+
+        template<typename T>
+        void operator()(T arg){
+            put_integer(out, arg);
+        }
+
+        void operator()(char arg){
+            out.push_back(arg);
+        }
+
+        void operator()(double arg){
+            char* b = out.reserve(32);
+            out.commit(std::to_chars(b, b + 32, arg, std::chars_format::general, 6).ptr - b);
+            // same digits as the ostream default (%g, precision 6)
+        }
+
+        void operator()(StringArg arg){
+            out.append(arg.s, arg.len);
+        }
+
+        void operator()(LogLine::string_literal_t arg){
+            out.append(arg.s, strlen(arg.s));
+        }
+    };
+
+    // SLOGF records: untagged arguments in the order of the call site's
+    // arg_types, spliced into its format string (validated at compile time)
+    template<typename Visitor>
+    void visit_format(Visitor& visitor, ByteBuffer& out, const CallSite* site, const char* data, const char* const end){
+        static constexpr auto table = make_visit_table<Visitor>(std::make_index_sequence<std::tuple_size<DataTypes>::value>());
+        const uint8_t* type = site -> arg_types();
+        const uint8_t* const last = type + site -> arg_count();
+        const char* fmt = site -> format();
+        const char* run = fmt;
+        while(*fmt != '\0'){
+            if(fmt[0] == '{' && fmt[1] == '}'){
+                out.append(run, fmt - run);
+                if(type < last && data < end && *type < table.size())   data = table[*type++](visitor, data);
+                run = fmt += 2;
+            }else if((fmt[0] == '{' && fmt[1] == '{') || (fmt[0] == '}' && fmt[1] == '}')){
+                out.append(run, fmt + 1 - run);
+                run = fmt += 2;
+            }else{
+                fmt++;
+            }
+        }
+        out.append(run, fmt - run);
     }
-    #endif
 
     template<typename T>
     void LogLine::encode(T arg){
@@ -167,123 +346,864 @@ namespace slog{
         encode<string_literal_t>(arg, TupleIndexHelper<string_literal_t, DataTypes>::value);
     }
 
-    LogLine::LogLine(LogSeverity level, const char* file, const char* func, uint32_t line)
+    namespace{
+        std::atomic<CallSite*>call_sites{nullptr};
+        std::atomic<uint32_t>call_site_count{0};
+
+        // told about every registered call site, earlier ones included; a
+        // persistent ring copies them out so a dead process's records stay readable
+        class CallSiteObserver{
+        public:
+            virtual ~CallSiteObserver() = default;
+            virtual void on_call_site(const CallSite& site) = 0;    // under observer_mutex
+        };
+
+        std::mutex observer_mutex;
+        std::vector<CallSiteObserver*>observers;
+        std::atomic<bool>has_observers{false};
+    }
+
+    CallSite::CallSite(const char* file, const char* func, uint32_t line, LogSeverity level, bool registered)
+        : CallSite(file, func, line, level, nullptr, nullptr, 0, registered){}
+
+    CallSite::CallSite(const char* file, const char* func, uint32_t line, LogSeverity level,
+        const char* format, const uint8_t* arg_types, uint8_t arg_count, bool registered)
+        : file_(file), func_(func), line_(line), level_(level),
+        format_(format), arg_types_(arg_types), arg_count_(arg_count), id_(UINT32_MAX){
+        if(!registered) return;
+        id_ = call_site_count.fetch_add(1, std::memory_order_relaxed);
+        next = call_sites.load(std::memory_order_relaxed);
+        // seq_cst pairs with add_observer: either it walks this site or we see its flag
+        while(!call_sites.compare_exchange_weak(next, this, std::memory_order_seq_cst, std::memory_order_relaxed));
+        if(has_observers.load(std::memory_order_seq_cst)){
+            std::lock_guard<std::mutex>lock(observer_mutex);
+            for(CallSiteObserver* observer : observers)   observer -> on_call_site(*this);
+        }
+    }
+
+    void for_each_call_site(const std::function<void(CallSite&)>& fn){
+        for(CallSite* site = call_sites.load(std::memory_order_acquire); site != nullptr; site = site -> next)    fn(*site);
+    }
+
+    namespace{
+        void add_observer(CallSiteObserver* observer){
+            std::lock_guard<std::mutex>lock(observer_mutex);
+            observers.push_back(observer);
+            has_observers.store(true, std::memory_order_seq_cst);
+            // a site registering right now may be reported twice, observers dedupe
+            for_each_call_site([observer](CallSite& site){observer -> on_call_site(site);});
+        }
+
+        void remove_observer(CallSiteObserver* observer){
+            std::lock_guard<std::mutex>lock(observer_mutex);
+            observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+            has_observers.store(!observers.empty(), std::memory_order_seq_cst);
+        }
+    }
+
+    LogLine::LogLine(const CallSite* site)
         : used_bytes(0), buffer_size(sizeof(stack_buffer)){
-        /* time, thread, file, func, line, level*/
-        slogtime::LogLineTime now;
-        encode<slogtime::LogLineTime>(now);
-        encode<std::thread::id>(this_thread_id());
-        encode<string_literal_t>(string_literal_t(file));
-        encode<string_literal_t>(string_literal_t(func));
-        encode<uint32_t>(line);
-        encode<LogSeverity>(level);
+        used_bytes = encode_header(stack_buffer, site) - stack_buffer;
     }
 
     LogLine::~LogLine() = default;
 
-    void LogLine::stream_to_string(std::ostream& s){
-        char* data = !heap_buffer ? stack_buffer : heap_buffer.get();
-        const char* const end = data + used_bytes;
+    slogtime::timestamp_t LogLine::timestamp() const{
+        const char* data = !heap_buffer ? stack_buffer : heap_buffer.get();
+        return *reinterpret_cast<const slogtime::timestamp_t*>(data);
+    }
 
-        slogtime::LogLineTime timenow = *reinterpret_cast<slogtime::LogLineTime*>(data);
-        data += sizeof(slogtime::LogLineTime);
-        
-        std::thread::id threadid = *reinterpret_cast<std::thread::id*>(data);
-        data += sizeof(std::thread::id);
+    const CallSite* LogLine::site() const{
+        const char* data = !heap_buffer ? stack_buffer : heap_buffer.get();
+        return *reinterpret_cast<const CallSite* const*>(data + sizeof(slogtime::timestamp_t) + sizeof(std::thread::id));
+    }
 
-        string_literal_t file = *reinterpret_cast<string_literal_t*>(data);
-        data += sizeof(string_literal_t);
+    LogSeverity LogLine::level() const{
+        return site() -> level();
+    }
 
-        string_literal_t function = *reinterpret_cast<string_literal_t*>(data);
-        data += sizeof(string_literal_t);
+    namespace{
+        // bytes a JSON string cannot carry as they are
+        inline bool needs_escape(unsigned char c){
+            return c < 0x20 || c == '"' || c == '\\';
+        }
 
-        uint32_t line = *reinterpret_cast<uint32_t*>(data); 
-        data += sizeof(uint32_t);
+        inline __attribute__((always_inline)) size_t clean_tail(const char* s, size_t n, size_t i){
+            while(i < n && !needs_escape(static_cast<unsigned char>(s[i]))) i++;
+            return i;
+        }
 
-        LogSeverity loglevel = *reinterpret_cast<LogSeverity*>(data);
-        data += sizeof(LogSeverity);
+        size_t clean_prefix_scalar(const char* s, size_t n){
+            return clean_tail(s, n, 0);
+        }
 
-        
-        
-        s << '[' << timenow.year() << '-' \
-                 << timenow.month() << '-' \
-                 << timenow.day() << '-' \
-                 << timenow.hour() << timenow.min() << timenow.sec();
-        if(FLAG_DEFAULT_WITH_MILLISEC) s << '-' << timenow.usec();
-        if(FLAG_GMT_OFFSET) s << '+' << timenow.gmtoffset().count();
-        if(FLAG_IS_DST) s << "-DST" << timenow.dst();
-        
+#if defined(__SSE2__)
+        // min(v, 0x1f) == v picks the control bytes, unsigned compares are not in SSE2.
+        // Inlined into the AVX2 kernel too, where it is VEX-encoded: calling legacy
+        // SSE code with the upper halves dirty costs ~150ns per call on some CPUs
+        inline __attribute__((always_inline)) size_t clean_blocks16(const char* s, size_t n, size_t i){
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i backslash = _mm_set1_epi8('\\');
+            const __m128i control = _mm_set1_epi8(0x1f);
+            for(; i + 16 <= n; i += 16){
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+                const __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                    _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+                const int mask = _mm_movemask_epi8(hit);
+                if(mask != 0)   return i + __builtin_ctz(mask);
+            }
+            return clean_tail(s, n, i);
+        }
 
-       
-        s << '[' << level_to_string(loglevel) << ']'
-        << '[' << threadid << ']'
-        << '[' << file.s
-        << ':' << function.s
-        << ':' << line << "] ";
+        size_t clean_prefix_sse2(const char* s, size_t n){
+            return clean_blocks16(s, n, 0);
+        }
 
-        if(ENABLE_CONSOLE_OUT){
-            std::cout << '[' << timenow.year() << '-' \
-                     << timenow.month() << '-' \
-                     << timenow.day() << '-' \
-                     << timenow.hour() << timenow.min() << timenow.sec();
-            if(FLAG_DEFAULT_WITH_MILLISEC) std::cout << '-' << timenow.usec();
-            if(FLAG_GMT_OFFSET) std::cout << '+' << timenow.gmtoffset().count();
-            if(FLAG_IS_DST) std::cout << "-DST" << timenow.dst();
-            std::cout << ']';
+        __attribute__((target("avx2")))
+        size_t clean_prefix_avx2(const char* s, size_t n){
+            const __m256i quote = _mm256_set1_epi8('"');
+            const __m256i backslash = _mm256_set1_epi8('\\');
+            const __m256i control = _mm256_set1_epi8(0x1f);
+            size_t i = 0;
+            for(; i + 32 <= n; i += 32){
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+                const __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+                    _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+                const uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+                if(mask != 0)   return i + __builtin_ctz(mask);
+            }
+            return clean_blocks16(s, n, i);
+        }
+#endif
 
+        struct EscapeKernel{
+            size_t (*clean_prefix)(const char* s, size_t n);
+            const char* name;
+        };
 
+        EscapeKernel pick_escape_kernel(){
+#if defined(__SSE2__)
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))  return {clean_prefix_avx2, "avx2"};
+            return {clean_prefix_sse2, "sse2"};
+#else
+            return {clean_prefix_scalar, "scalar"};
+#endif
+        }
 
-            std::cout << '[' << color_level(loglevel) << level_to_string(loglevel) << TERM_RESET << ']'
-            << '[' << threadid << ']'
-            << TERM_BOLD
-            << file.s
-            << ':' << function.s
-            << ':' << line
-            << ": " << TERM_RESET;
+        const EscapeKernel& kernel(){
+            static const EscapeKernel picked = pick_escape_kernel();
+            return picked;
         }
 
-        stream_to_string(s, data, end);
+        void put_escaped(ByteBuffer& out, unsigned char c){
+            static const char hex[] = "0123456789abcdef";
+            char* b = out.reserve(6);
+            b[0] = '\\';
+            switch(c){
+                case '"':   b[1] = '"'; break;
+                case '\\':  b[1] = '\\'; break;
+                case '\n':  b[1] = 'n'; break;
+                case '\r':  b[1] = 'r'; break;
+                case '\t':  b[1] = 't'; break;
+                default:
+                    memcpy(b + 1, "u00", 3);
+                    b[4] = hex[c >> 4];
+                    b[5] = hex[c & 15];
+                    out.commit(6);
+                    return;
+            }
+            out.commit(2);
+        }
 
-        s << std::endl;
-        if(ENABLE_CONSOLE_OUT) std::cout << std::endl;
+        void escape_with(size_t (*clean_prefix)(const char*, size_t), ByteBuffer& out, const char* s, size_t n){
+            for(;;){
+                const size_t clean = clean_prefix(s, n);
+                out.append(s, clean);
+                if(clean == n)  return;
+                put_escaped(out, static_cast<unsigned char>(s[clean]));
+                s += clean + 1;
+                n -= clean + 1;
+            }
+        }
+    }
 
-        if (loglevel >= LogSeverity::FATAL) {
-            s.flush();
-        }      
+    void escape_json(ByteBuffer& out, const char* s, size_t n){
+        escape_with(kernel().clean_prefix, out, s, n);
     }
 
-    void LogLine::stream_to_string(std::ostream& s, char* start, const char* const end){
-        if(start == end)    return;
-        int id = static_cast<int>(*start);
-        start++;
-        
-        switch(id){
-            case 0:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<0, DataTypes>::type*>(nullptr)), end);
-                return;
-            case 1:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<1, DataTypes>::type*>(nullptr)), end);
-                return;
-            case 2:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<2, DataTypes>::type*>(nullptr)), end);
-                return;
-            case 3:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<3, DataTypes>::type*>(nullptr)), end);
-                return;
-            case 4:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<4, DataTypes>::type*>(nullptr)), end);
-                return;
-            case 5:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<5, DataTypes>::type*>(nullptr)), end);
-                return;
-            case 6:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<6, DataTypes>::type*>(nullptr)), end);
+    void escape_json_scalar(ByteBuffer& out, const char* s, size_t n){
+        escape_with(clean_prefix_scalar, out, s, n);
+    }
+
+    const char* escape_kernel(){
+        return kernel().name;
+    }
+
+    namespace{
+        constexpr const size_t lz_min_match = 4;
+        constexpr const size_t lz_end_literals = 5;     // matches stop short of the end of a block
+        constexpr const size_t lz_match_start = 12;     // and do not start in its last bytes
+        constexpr const size_t lz_window = 65535;
+
+        inline uint32_t load32(const char* p){
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint64_t load64(const char* p){
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline uint32_t lz_hash(uint32_t v, int bits){
+            return (v * 2654435761u) >> (32 - bits);
+        }
+
+        // bytes a and b have in common, b stopping at limit
+        inline size_t match_length(const char* a, const char* b, const char* limit){
+            const char* const start = b;
+            for(; b + 8 <= limit; a += 8, b += 8){
+                const uint64_t diff = load64(a) ^ load64(b);
+                if(diff != 0)   return b - start + (__builtin_ctzll(diff) >> 3);
+            }
+            while(b < limit && *a == *b){
+                a++;
+                b++;
+            }
+            return b - start;
+        }
+
+        // the part of a length past the 15 its token nibble holds, in bytes of up to 255
+        char* put_length(char* op, size_t len){
+            for(; len >= 255; len -= 255)   *op++ = static_cast<char>(255);
+            *op++ = static_cast<char>(len);
+            return op;
+        }
+
+        char* put_literals(char* op, const char* literals, size_t len, unsigned match_nibble){
+            *op++ = static_cast<char>((std::min<size_t>(len, 15) << 4) | match_nibble);
+            if(len >= 15)   op = put_length(op, len - 15);
+            memcpy(op, literals, len);
+            return op + len;
+        }
+
+        char* put_sequence(char* op, const char* literals, size_t literal_len, size_t offset, size_t match_len){
+            const size_t extra = match_len - lz_min_match;
+            op = put_literals(op, literals, literal_len, static_cast<unsigned>(std::min<size_t>(extra, 15)));
+            *op++ = static_cast<char>(offset & 0xff);
+            *op++ = static_cast<char>(offset >> 8);
+            if(extra >= 15) op = put_length(op, extra - 15);
+            return op;
+        }
+
+        // level 1: one hash probe per position, skipping ahead faster the longer nothing matches
+        size_t compress_fast(const char* in, size_t n, char* out){
+            constexpr int bits = 14;
+            static thread_local uint32_t table[1 << bits];
+            memset(table, 0, sizeof(table));
+            char* op = out;
+            const char* anchor = in;
+            if(n > lz_match_start){
+                const char* const match_limit = in + n - lz_end_literals;
+                const char* const start_limit = in + n - lz_match_start;
+                size_t misses = 0;
+                for(const char* ip = in + 1; ip < start_limit;){
+                    const uint32_t h = lz_hash(load32(ip), bits);
+                    const char* ref = in + table[h];
+                    table[h] = static_cast<uint32_t>(ip - in);
+                    if(ref >= ip || static_cast<size_t>(ip - ref) > lz_window || load32(ref) != load32(ip)){
+                        ip += 1 + (misses++ >> 6);
+                        continue;
+                    }
+                    misses = 0;
+                    while(ip > anchor && ref > in && ip[-1] == ref[-1]){
+                        ip--;
+                        ref--;
+                    }
+                    const size_t len = lz_min_match + match_length(ref + lz_min_match, ip + lz_min_match, match_limit);
+                    op = put_sequence(op, anchor, ip - anchor, ip - ref, len);
+                    ip += len;
+                    anchor = ip;
+                    if(ip < start_limit)    table[lz_hash(load32(ip - 2), bits)] = static_cast<uint32_t>(ip - 2 - in);
+                }
+            }
+            return put_literals(op, anchor, in + n - anchor, 0) - out;
+        }
+
+        // levels 2 to 9: every position goes into hash chains searched 4 to 512 deep,
+        // and a match is put off by a byte while the next position has a longer one
+        size_t compress_chain(const char* in, size_t n, char* out, int level){
+            constexpr int bits = 16;
+            constexpr uint32_t none = UINT32_MAX;
+            constexpr size_t mask = 65535;
+            static thread_local std::unique_ptr<uint32_t[]>head(new uint32_t[1 << bits]);
+            static thread_local std::unique_ptr<uint32_t[]>prev(new uint32_t[mask + 1]);
+            std::fill(head.get(), head.get() + (1 << bits), none);
+            const unsigned depth = 4u << (level - 2);
+            const size_t good_enough = 32u << (level - 2);  // a match this long ends the search
+            char* op = out;
+            const char* anchor = in;
+            if(n > lz_match_start){
+                const char* const match_limit = in + n - lz_end_literals;
+                const char* const start_limit = in + n - lz_match_start;
+                auto insert = [&](const char* p){
+                    const uint32_t pos = static_cast<uint32_t>(p - in);
+                    const uint32_t h = lz_hash(load32(p), bits);
+                    prev[pos & mask] = head[h];
+                    head[h] = pos;
+                };
+                auto find = [&](const char* p, size_t& offset){
+                    size_t best = 0;
+                    uint32_t candidate = head[lz_hash(load32(p), bits)];
+                    for(unsigned i = 0; i < depth && candidate != none; i++){
+                        const char* ref = in + candidate;
+                        // a slot reused by a later position can send the chain forward
+                        if(ref >= p || static_cast<size_t>(p - ref) > lz_window)    break;
+                        if(load32(ref) == load32(p) && (best == 0 || ref[best] == p[best])){
+                            const size_t len = lz_min_match + match_length(ref + lz_min_match, p + lz_min_match, match_limit);
+                            if(len > best){
+                                best = len;
+                                offset = p - ref;
+                                if(best >= good_enough) break;
+                            }
+                        }
+                        candidate = prev[candidate & mask];
+                    }
+                    return best;
+                };
+                for(const char* ip = in; ip < start_limit;){
+                    size_t offset = 0;
+                    size_t len = find(ip, offset);
+                    insert(ip);
+                    if(len == 0){
+                        ip++;
+                        continue;
+                    }
+                    while(ip + 1 < start_limit){
+                        size_t next_offset = 0;
+                        const size_t next_len = find(ip + 1, next_offset);
+                        if(next_len <= len) break;
+                        insert(++ip);
+                        len = next_len;
+                        offset = next_offset;
+                    }
+                    op = put_sequence(op, anchor, ip - anchor, offset, len);
+                    const char* const end = ip + len;
+                    for(ip++; ip < end; ip++){
+                        if(ip < start_limit)    insert(ip);
+                    }
+                    anchor = ip;
+                }
+            }
+            return put_literals(op, anchor, in + n - anchor, 0) - out;
+        }
+    }
+
+    size_t lz_bound(size_t n){
+        return n + n / 255 + 16;
+    }
+
+    size_t lz_compress(const char* in, size_t n, char* out, int level){
+        return level <= 1 ? compress_fast(in, n, out) : compress_chain(in, n, out, std::min(level, 9));
+    }
+
+    bool lz_decompress(const char* in, size_t n, char* out, size_t raw){
+        const unsigned char* ip = reinterpret_cast<const unsigned char*>(in);
+        const unsigned char* const end = ip + n;
+        char* op = out;
+        char* const out_end = out + raw;
+        auto get_length = [&](size_t& len){
+            for(;;){
+                if(ip == end)   return false;
+                const unsigned byte = *ip++;
+                len += byte;
+                if(byte != 255) return true;
+            }
+        };
+        while(ip < end){
+            const unsigned token = *ip++;
+            size_t literals = token >> 4;
+            if(literals == 15 && !get_length(literals)) return false;
+            if(literals > static_cast<size_t>(end - ip) || literals > static_cast<size_t>(out_end - op))   return false;
+            memcpy(op, ip, literals);
+            op += literals;
+            ip += literals;
+            if(ip == end)   break;  // the last sequence is literals only
+            if(end - ip < 2)    return false;
+            const size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            size_t len = token & 15;
+            if(len == 15 && !get_length(len))   return false;
+            len += lz_min_match;
+            if(offset == 0 || offset > static_cast<size_t>(op - out) || len > static_cast<size_t>(out_end - op))  return false;
+            const char* ref = op - offset;
+            if(offset >= 8 && static_cast<size_t>(out_end - op) >= len + 8){
+                // 8 bytes at a time, a source at least 8 back is written before it is read
+                for(size_t i = 0; i < len; i += 8)  memcpy(op + i, ref + i, 8);
+            }else{
+                for(size_t i = 0; i < len; i++) op[i] = ref[i];
+            }
+            op += len;
+        }
+        return op == out_end;
+    }
+
+    bool lz_unpack(const LzBlock& block, const char* payload, char* out){
+        if((block.packed_bytes & lz_stored) == 0)   return lz_decompress(payload, block.packed_bytes, out, block.raw_bytes);
+        if((block.packed_bytes & ~lz_stored) != block.raw_bytes)    return false;
+        memcpy(out, payload, block.raw_bytes);
+        return true;
+    }
+
+    bool lz_read_file(const std::string& path, std::string& out){
+        std::ifstream in(path, std::ios::binary);
+        const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        LzFileHeader header;
+        if(data.size() < sizeof(header))    return false;
+        memcpy(&header, data.data(), sizeof(header));
+        if(memcmp(header.magic, lz_magic, sizeof(lz_magic)) != 0 || header.version != lz_version)  return false;
+        for(size_t pos = sizeof(header); pos + sizeof(LzBlock) <= data.size();){
+            LzBlock block;
+            memcpy(&block, data.data() + pos, sizeof(block));
+            pos += sizeof(block);
+            const size_t packed = block.packed_bytes & ~lz_stored;
+            if(block.raw_bytes == 0 || packed > data.size() - pos)  break;  // torn by a crash
+            const size_t at = out.size();
+            out.resize(at + block.raw_bytes);
+            if(!lz_unpack(block, data.data() + pos, &out[at])){
+                out.resize(at);
+                break;
+            }
+            pos += packed;
+        }
+        return true;
+    }
+
+    class ThreadIdCache{
+    public:
+        // std::thread::id has no to_chars, format each id through ostream once
+        const std::string& get(std::thread::id id){
+            if(last != nullptr && id == last_id)    return *last;
+            auto it = names.find(id);
+            if(it == names.end()){
+                if(names.size() >= 4096)    names.clear();
+                std::ostringstream os;
+                os << id;
+                it = names.emplace(id, os.str()).first;
+            }
+            last_id = id;
+            return *(last = &it -> second);
+        }
+
+    private:
+        std::unordered_map<std::thread::id, std::string>names;
+        std::thread::id last_id;
+        const std::string* last = nullptr;
+    };
+
+    template<TimePrecision precision>
+    void put_subseconds(ByteBuffer& out, slogtime::timestamp_t ts){
+        constexpr int digits = precision == TimePrecision::MILLISECONDS ? 3
+            : precision == TimePrecision::MICROSECONDS ? 6
+            : precision == TimePrecision::NANOSECONDS ? 9 : 0;
+        if(digits == 0) return;
+        uint32_t fraction = static_cast<uint32_t>(ts % 1000000000);
+        for(int i = digits; i < 9; i++) fraction /= 10;
+        char* b = out.reserve(digits);
+        for(int i = digits - 1; i >= 0; i--){
+            b[i] = static_cast<char>('0' + fraction % 10);
+            fraction /= 10;
+        }
+        out.commit(digits);
+    }
+
+    // the line layout chosen by Config. What only changes once a second is
+    // rebuilt from these fields then; the per-record path is a formatter
+    // specialized on the rest, picked once by make_formatter
+    class LineFormatter{
+    public:
+        // JSON and LOGFMT carry a bare ISO8601 time, TEXT the configured one in brackets
+        LineFormatter(const Config& config, bool subseconds, bool text)
+          : layout(text ? config.time_layout : TimeLayout::ISO8601), gmt_offset(config.gmt_offset),
+          dst(text && config.dst), subseconds(subseconds), bracket(text){}
+        virtual ~LineFormatter() = default;
+
+        virtual void format(const LogLine& line, ByteBuffer& out) const = 0;    // appends the line, '\n' included
+
+        // the fixed part of a record, and where its arguments are
+        struct Record{
+            slogtime::timestamp_t ts;
+            std::thread::id thread;
+            const CallSite* site;
+            const char* args;
+            const char* end;
+        };
+
+    protected:
+        static Record decode(const LogLine& line){
+            const char* data = !line.heap_buffer ? line.stack_buffer : line.heap_buffer.get();
+            Record record;
+            record.end = data + line.size();
+            record.ts = *reinterpret_cast<const slogtime::timestamp_t*>(data);
+            data += sizeof(slogtime::timestamp_t);
+            record.thread = *reinterpret_cast<const std::thread::id*>(data);
+            data += sizeof(std::thread::id);
+            record.site = *reinterpret_cast<const CallSite* const*>(data);
+            record.args = data + sizeof(const CallSite*);
+            return record;
+        }
+
+        static const std::string& thread_name(std::thread::id id){
+            static thread_local ThreadIdCache thread_cache;    // the consumer or a format worker
+            return thread_cache.get(id);
+        }
+
+        template<TimePrecision precision>
+        void put_time(ByteBuffer& out, slogtime::timestamp_t ts) const{
+            static thread_local TimePrefixCache time_cache;
+            time_cache.get(ts, this);
+            out.append(time_cache.date_time().data(), time_cache.date_time().size());
+            put_subseconds<precision>(out, ts);
+            out.append(time_cache.zone().data(), time_cache.zone().size());
+        }
+
+        class TimePrefixCache{
+        public:
+            // calendar fields only change once a second, so localtime_r and the
+            // date/time text are redone only when the second rolls over
+            void get(slogtime::timestamp_t ts, const LineFormatter* formatter){
+                const uint64_t sec = ts / 1000000000;
+                if(sec == cached_sec && formatter == owner) return;
+                cached_sec = sec;
+                owner = formatter;
+                const slogtime::LogLineTime timenow(ts);
+                const bool iso = formatter -> layout == TimeLayout::ISO8601;
+                prefix.clear();
+                if(formatter -> bracket)    prefix.push_back('[');
+                put_integer(prefix, timenow.year());
+                prefix.push_back('-');
+                put_field(prefix, timenow.month(), iso);
+                prefix.push_back('-');
+                put_field(prefix, timenow.day(), iso);
+                prefix.push_back(iso ? 'T' : '-');
+                put_field(prefix, timenow.hour(), iso);
+                if(iso) prefix.push_back(':');
+                put_field(prefix, timenow.min(), iso);
+                if(iso) prefix.push_back(':');
+                put_field(prefix, timenow.sec(), iso);
+                if(formatter -> subseconds) prefix.push_back(iso ? '.' : '-');
+                suffix.clear();
+                if(formatter -> gmt_offset){
+                    const long offset = timenow.gmtoffset().count();
+                    if(iso){
+                        suffix.push_back(offset < 0 ? '-' : '+');
+                        put_field(suffix, static_cast<int>(std::abs(offset) / 3600), true);
+                        suffix.push_back(':');
+                        put_field(suffix, static_cast<int>(std::abs(offset) % 3600 / 60), true);
+                    }else{
+                        suffix.push_back('+');
+                        put_integer(suffix, offset);
+                    }
+                }
+                if(formatter -> dst && !iso){
+                    suffix.append("-DST", 4);
+                    put_integer(suffix, timenow.dst());
+                }
+                if(iso && formatter -> bracket) suffix.push_back(']');
+            }
+
+            const ByteBuffer& date_time() const noexcept{return prefix;}    // subsecond separator included
+            const ByteBuffer& zone() const noexcept{return suffix;}     // offset and DST fields, ISO8601 closes the bracket
+
+        private:
+            uint64_t cached_sec = UINT64_MAX;
+            const LineFormatter* owner = nullptr;
+            ByteBuffer prefix{64};
+            ByteBuffer suffix{64};
+
+            static void put_field(ByteBuffer& out, int value, bool padded){
+                if(padded && value < 10)    out.push_back('0');
+                put_integer(out, value);
+            }
+        };
+
+    private:
+        const TimeLayout layout;
+        const bool gmt_offset;
+        const bool dst;
+        const bool subseconds;
+        const bool bracket;
+    };
+
+    template<size_t N>
+    void put_literal(ByteBuffer& out, const char (&s)[N]){
+        out.append(s, N - 1);
+    }
+
+    template<TimePrecision precision>
+    class TextFormatter final : public LineFormatter{
+    public:
+        explicit TextFormatter(const Config& config)
+          : LineFormatter(config, precision != TimePrecision::SECONDS, true){}
+
+        void format(const LogLine& line, ByteBuffer& out) const override{
+            const Record record = decode(line);
+            const CallSite* site = record.site;
+            put_time<precision>(out, record.ts);
+
+            const char* level = level_to_string(site -> level());
+            const std::string& thread = thread_name(record.thread);
+            out.push_back('[');
+            out.append(level, strlen(level));
+            out.append("][", 2);
+            out.append(thread.data(), thread.size());
+            out.append("][", 2);
+            out.append(site -> file(), strlen(site -> file()));
+            out.push_back(':');
+            out.append(site -> func(), strlen(site -> func()));
+            out.push_back(':');
+            put_integer(out, site -> line());
+            out.append("] ", 2);
+
+            TextArgs args{out};
+            if(site -> format() != nullptr) visit_format(args, out, site, record.args, record.end);
+            else    visit_args(args, record.args, record.end);
+            out.push_back('\n');
+        }
+    };
+
+    // how JSON and LOGFMT lines write a field
+    struct JsonFields{
+        static void key(ByteBuffer& out, FieldArg key){
+            put_literal(out, ",\"");
+            escape_json(out, key.s, key.len);
+            put_literal(out, "\":");
+        }
+
+        static void string(ByteBuffer& out, const char* s, size_t n){
+            out.push_back('"');
+            escape_json(out, s, n);
+            out.push_back('"');
+        }
+
+        static void real(ByteBuffer& out, double arg){
+            if(std::isfinite(arg)){
+                TextArgs{out}(arg);
                 return;
-            case 7:
-                stream_to_string(s, decode(s, start, static_cast<std::tuple_element<7, DataTypes>::type*>(nullptr)), end);
+            }
+            out.push_back('"');     // JSON numbers have no inf or nan
+            TextArgs{out}(arg);
+            out.push_back('"');
+        }
+    };
+
+    struct LogfmtFields{
+        static void key(ByteBuffer& out, FieldArg key){
+            out.push_back(' ');
+            out.append(key.s, key.len);
+            out.push_back('=');
+        }
+
+        static void string(ByteBuffer& out, const char* s, size_t n){
+            // bare unless it would split the pair
+            if(n != 0 && kernel().clean_prefix(s, n) == n && memchr(s, ' ', n) == nullptr && memchr(s, '=', n) == nullptr){
+                out.append(s, n);
                 return;
+            }
+            out.push_back('"');
+            escape_json(out, s, n);
+            out.push_back('"');
+        }
+
+        static void real(ByteBuffer& out, double arg){
+            TextArgs{out}(arg);
+        }
+    };
+
+    // plain arguments make up the message text, a kv() value goes to fields
+    // under its key instead, typed
+    template<typename Fields>
+    struct StructuredArgs{
+        ByteBuffer& msg;
+        ByteBuffer& fields;
+        FieldArg key{nullptr, 0};
+
+        void operator()(FieldArg next){
+            finish();
+            key = next;
+        }
+
+        template<typename T>
+        void operator()(T arg){
+            if(field()) put_integer(fields, arg);
+            else    TextArgs{msg}(arg);
+        }
+
+        void operator()(char arg){
+            if(field()) Fields::string(fields, &arg, 1);
+            else    msg.push_back(arg);
+        }
+
+        void operator()(double arg){
+            if(field()) Fields::real(fields, arg);
+            else    TextArgs{msg}(arg);
+        }
+
+        void operator()(StringArg arg){
+            if(field()) Fields::string(fields, arg.s, arg.len);
+            else    msg.append(arg.s, arg.len);
+        }
+
+        void operator()(LogLine::string_literal_t arg){
+            if(field()) Fields::string(fields, arg.s, strlen(arg.s));
+            else    msg.append(arg.s, strlen(arg.s));
+        }
+
+        void finish(){
+            // an empty string value is not encoded, the key is all that is left of it
+            if(field()) Fields::string(fields, "", 0);
+            while(msg.size() != 0 && msg.data()[msg.size() - 1] == ' ') msg.truncate(msg.size() - 1);
+        }
+
+    private:
+        bool field(){
+            if(key.s == nullptr)    return false;
+            Fields::key(fields, key);
+            key.s = nullptr;
+            return true;
+        }
+    };
+
+    template<typename Fields>
+    void split_args(const LineFormatter::Record& record, ByteBuffer& msg, ByteBuffer& fields){
+        msg.clear();
+        fields.clear();
+        if(record.site -> format() != nullptr){
+            TextArgs args{msg};
+            visit_format(args, msg, record.site, record.args, record.end);
+            return;
+        }
+        StructuredArgs<Fields> args{msg, fields};
+        visit_args(args, record.args, record.end);
+        args.finish();
+    }
+
+    // {"ts":"...","level":"Info","thread":"...","file":"...","func":"...","line":1,"msg":"...",fields}
+    template<TimePrecision precision>
+    class JsonFormatter final : public LineFormatter{
+    public:
+        explicit JsonFormatter(const Config& config)
+          : LineFormatter(config, precision != TimePrecision::SECONDS, false){}
+
+        void format(const LogLine& line, ByteBuffer& out) const override{
+            static thread_local ByteBuffer msg;
+            static thread_local ByteBuffer fields;
+            const Record record = decode(line);
+            const CallSite* site = record.site;
+            split_args<JsonFields>(record, msg, fields);
+
+            put_literal(out, "{\"ts\":\"");
+            put_time<precision>(out, record.ts);
+            put_literal(out, "\",\"level\":\"");
+            const char* level = level_to_string(site -> level());
+            out.append(level, strlen(level));
+            put_literal(out, "\",\"thread\":\"");
+            const std::string& thread = thread_name(record.thread);
+            out.append(thread.data(), thread.size());
+            put_literal(out, "\",\"file\":\"");
+            escape_json(out, site -> file(), strlen(site -> file()));
+            put_literal(out, "\",\"func\":\"");
+            escape_json(out, site -> func(), strlen(site -> func()));
+            put_literal(out, "\",\"line\":");
+            put_integer(out, site -> line());
+            put_literal(out, ",\"msg\":\"");
+            escape_json(out, msg.data(), msg.size());
+            out.push_back('"');
+            out.append(fields.data(), fields.size());
+            put_literal(out, "}\n");
+        }
+    };
+
+    // ts=... level=Info thread=... file=... func=... line=1 msg="..." fields
+    template<TimePrecision precision>
+    class LogfmtFormatter final : public LineFormatter{
+    public:
+        explicit LogfmtFormatter(const Config& config)
+          : LineFormatter(config, precision != TimePrecision::SECONDS, false){}
+
+        void format(const LogLine& line, ByteBuffer& out) const override{
+            static thread_local ByteBuffer msg;
+            static thread_local ByteBuffer fields;
+            const Record record = decode(line);
+            const CallSite* site = record.site;
+            split_args<LogfmtFields>(record, msg, fields);
+
+            put_literal(out, "ts=");
+            put_time<precision>(out, record.ts);
+            put_literal(out, " level=");
+            const char* level = level_to_string(site -> level());
+            out.append(level, strlen(level));
+            put_literal(out, " thread=");
+            const std::string& thread = thread_name(record.thread);
+            out.append(thread.data(), thread.size());
+            put_literal(out, " file=");
+            LogfmtFields::string(out, site -> file(), strlen(site -> file()));
+            put_literal(out, " func=");
+            LogfmtFields::string(out, site -> func(), strlen(site -> func()));
+            put_literal(out, " line=");
+            put_integer(out, site -> line());
+            put_literal(out, " msg=\"");
+            escape_json(out, msg.data(), msg.size());
+            out.push_back('"');
+            out.append(fields.data(), fields.size());
+            out.push_back('\n');
         }
-    }    
+    };
+
+    namespace{
+        template<template<TimePrecision> class Formatter>
+        std::unique_ptr<LineFormatter> make_formatter(const Config& config){
+            switch(config.time_precision){
+                case TimePrecision::MILLISECONDS:
+                    return std::unique_ptr<LineFormatter>(new Formatter<TimePrecision::MILLISECONDS>(config));
+                case TimePrecision::MICROSECONDS:
+                    return std::unique_ptr<LineFormatter>(new Formatter<TimePrecision::MICROSECONDS>(config));
+                case TimePrecision::NANOSECONDS:
+                    return std::unique_ptr<LineFormatter>(new Formatter<TimePrecision::NANOSECONDS>(config));
+                default:
+                    return std::unique_ptr<LineFormatter>(new Formatter<TimePrecision::SECONDS>(config));
+            }
+        }
+
+        // BINARY files still need TEXT lines for the sinks
+        std::unique_ptr<LineFormatter> make_formatter(const Config& config){
+            switch(config.format){
+                case OutputFormat::JSON:
+                    return make_formatter<JsonFormatter>(config);
+                case OutputFormat::LOGFMT:
+                    return make_formatter<LogfmtFormatter>(config);
+                default:
+                    return make_formatter<TextFormatter>(config);
+            }
+        }
+    }
+
+    void LogLine::format(ByteBuffer& out){
+        // the default layout, for tools that have no Config at hand
+        static const TextFormatter<TimePrecision::SECONDS> plain{Config()};
+        plain.format(*this, out);
+    }
+
+    void LogLine::stream_to_string(std::ostream& s){
+        static thread_local ByteBuffer text;
+        text.clear();
+        format(text);
+        s.write(text.data(), text.size());
+        if(level() >= LogSeverity::FATAL)   s.flush();
+    }
 
     /* operators reload */
     LogLine& LogLine::operator<<(char arg){
@@ -335,11 +1255,145 @@ namespace slog{
         std::atomic_flag& flag;
     };
 
-    class BufferBase{
-    public:
-        virtual ~BufferBase() = default;
-        virtual void push(LogLine&& logline) = 0;
+    inline void cpu_relax(){
+    #if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+    #elif defined(__aarch64__)
+        asm volatile("yield");
+    #endif
+    }
+
+    class Parker{
+    public:
+        template<typename Ready>
+        void park(Ready ready, std::chrono::microseconds timeout){
+            std::unique_lock<std::mutex>lock(mutex);
+            signaled.store(false, std::memory_order_relaxed);
+            sleepers.fetch_add(1, std::memory_order_seq_cst);
+            if(!ready())    cv.wait_for(lock, timeout);
+            // a wakeup lost to the ready()/unpark() race costs at most one timeout
+            sleepers.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        void unpark(){
+            if(sleepers.load(std::memory_order_relaxed) == 0)  return;
+            if(signaled.exchange(true, std::memory_order_acq_rel))  return;
+            // first waker after a park notifies, later ones see signaled and skip
+            std::lock_guard<std::mutex>lock(mutex);
+            cv.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::atomic<unsigned int>sleepers{0};
+        std::atomic<bool>signaled{false};
+    };
+
+    class Waiter{
+    public:
+        Waiter(WaitStrategy strategy, const Config& config, Parker* parker = nullptr)
+          : strategy(strategy),
+          max_nap(config.max_backoff_us),
+          park_timeout(config.park_timeout_us),
+          parker(parker){}
+
+        template<typename Ready>
+        void wait(Ready ready){
+            ++rounds;
+            if(strategy == WaitStrategy::SPIN || rounds < spin_rounds){
+                cpu_relax();
+                return;
+            }
+            switch(strategy){
+                case WaitStrategy::YIELD:
+                    std::this_thread::yield();
+                    return;
+                case WaitStrategy::BACKOFF:
+                    if(rounds < yield_rounds){
+                        std::this_thread::yield();
+                        return;
+                    }
+                    std::this_thread::sleep_for(nap);
+                    nap = std::min(nap * 2, max_nap);
+                    return;
+                case WaitStrategy::BLOCK:
+                    if(parker == nullptr)   std::this_thread::yield();
+                    else    parker -> park(ready, park_timeout);
+                    return;
+                default:
+                    cpu_relax();
+                    return;
+            }
+        }
+
+        void reset(){
+            rounds = 0;
+            nap = std::chrono::microseconds(1);
+        }
+
+    private:
+        static constexpr const unsigned int spin_rounds = 256;
+        static constexpr const unsigned int yield_rounds = 512;
+
+        const WaitStrategy strategy;
+        const std::chrono::microseconds max_nap;
+        const std::chrono::microseconds park_timeout;
+        Parker* parker;
+        unsigned int rounds = 0;
+        std::chrono::microseconds nap{1};
+    };
+
+    class BufferBase{
+    public:
+        virtual ~BufferBase() = default;
+        virtual bool push(LogLine&& logline) = 0;  // false if the record was dropped
         virtual bool pop(LogLine& logline) = 0;
+        virtual bool empty() = 0;  // consumer side only
+        virtual uint64_t depth() = 0;  // consumer side only, records waiting, a sample
+        virtual uint64_t dropped() const = 0;
+
+        // room for a record of bytes encoded in place, nullptr if it is dropped;
+        // queues of LogLine slots stage it in a per-thread LogLine
+        virtual char* reserve(size_t bytes){
+            LogLine& line = staging();
+            line.heap_buffer.reset();
+            line.buffer_size = sizeof(line.stack_buffer);
+            line.used_bytes = 0;
+            line.resize_buffer(bytes);
+            line.used_bytes = bytes;
+            return !line.heap_buffer ? line.stack_buffer : line.heap_buffer.get();
+        }
+
+        virtual void commit(char*){
+            push(std::move(staging()));
+        }
+
+        // consumer, once every record popped so far has reached the file; only
+        // a queue that keeps popped records until then acts on it
+        virtual void release(){}
+        virtual bool keeps() const noexcept{return false;}     // whether it acts on release()
+
+    protected:
+        static LogLine& staging(){
+            static thread_local LogLine line(nullptr);
+            return line;
+        }
+
+        static void assign(LogLine& logline, const char* record, size_t bytes){
+            logline.used_bytes = 0;
+            logline.resize_buffer(bytes);
+            memcpy(!logline.heap_buffer ? logline.stack_buffer : logline.heap_buffer.get(), record, bytes);
+            logline.used_bytes = bytes;
+        }   // consumer side, a heap buffer once grown is kept for later records
+
+        static const char* data(LogLine& logline){
+            return logline.buffer() - logline.used_bytes;
+        }
+
+        static size_t size(const LogLine& logline){
+            return logline.used_bytes;
+        }
     };
 
     class Buffer{
@@ -353,13 +1407,13 @@ namespace slog{
         static constexpr const size_t size = 32768;
 
         Buffer() : items(static_cast<Item*>(std::malloc(size * sizeof(Item)))){
+            memset(static_cast<void*>(items), 0, size * sizeof(Item));  // pre-fault pages off the producer path
             for(size_t i = 0; i <= size; i++)   write_state[i].store(0, std::memory_order_relaxed);
             static_assert(sizeof(Item) == 256);
         }
 
         ~Buffer(){
-            unsigned int write_cnt = write_state[size].load();
-            for(size_t i = 0; i < write_cnt; i++)   items[i].~Item();
+            clear();
             std::free(items);
         }
 
@@ -369,6 +1423,10 @@ namespace slog{
             return write_state[size].fetch_add(1, std::memory_order_acquire) + 1 == size;
         }
 
+        bool ready(const unsigned int read_index){
+            return write_state[read_index].load(std::memory_order_acquire);
+        }
+
         bool pop(LogLine& logline, const unsigned int read_index){
             if(write_state[read_index].load(std::memory_order_acquire)){
                 Item& item = items[read_index];
@@ -378,6 +1436,12 @@ namespace slog{
             return false;
         }
 
+        void clear(){
+            unsigned int write_cnt = write_state[size].load();
+            for(size_t i = 0; i < write_cnt; i++)   items[i].~Item();
+            for(size_t i = 0; i <= size; i++)   write_state[i].store(0, std::memory_order_relaxed);
+        }   // make the buffer reusable, only when no producer or consumer holds it
+
         Buffer(const Buffer&) = delete;
         Buffer& operator=(const Buffer&) = delete;
 
@@ -388,21 +1452,57 @@ namespace slog{
 
     class QueueBuffer : public BufferBase{
     public:
-        QueueBuffer() : r_cursor{nullptr}, write_index(0), flag{ATOMIC_FLAG_INIT}, read_index(0){
+        explicit QueueBuffer(const Config& config)
+          : config(config), r_cursor{nullptr}, write_index(0), read_index(0), flag{ATOMIC_FLAG_INIT}{
+            const size_t pool_size = std::max(2u, config.max_buffers);
+            for(size_t i = 0; i < pool_size; i++){
+                pool.emplace_back(new Buffer());
+                free_buffers.push_back(pool.back().get());
+            }
             create_buffer();
         }
 
-        void push(LogLine&& logline) override{
+        bool push(LogLine&& logline) override{
+            if(starved.load(std::memory_order_relaxed) && config.overflow == OverflowPolicy::DROP_NEWEST){
+                dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
             unsigned int windex = write_index.fetch_add(1, std::memory_order_relaxed);
             if(windex < Buffer::size){
                 if(w_cursor.load(std::memory_order_acquire) -> push(std::move(logline), windex)){
                     create_buffer();
                 }
             }else{
-                while(write_index.load(std::memory_order_acquire) >= Buffer::size);
+                Waiter waiter(config.producer_wait, config, &producer_parker);
+                auto ready = [this]{
+                    return write_index.load(std::memory_order_acquire) < Buffer::size
+                        || (starved.load(std::memory_order_acquire) && config.overflow == OverflowPolicy::DROP_NEWEST);
+                };
+                if(!ready()){
+                    Stall stall;
+                    while(!ready()) waiter.wait(ready);
+                }
                 // wait until buffer is available
-                push(std::move(logline));
+                return push(std::move(logline));
+            }
+            return true;
+        }
+
+        bool empty() override{
+            Buffer* rcursor = r_cursor != nullptr ? r_cursor : get_rbuffer();
+            return rcursor == nullptr || !rcursor -> ready(read_index);
+        }
+
+        uint64_t depth() override{
+            // full buffers queued behind the one being read, plus the claimed slots of the last
+            size_t queued;
+            {
+                SpinLock spinlock(flag);
+                queued = buffers.size();
             }
+            if(queued == 0) return 0;
+            const uint64_t claimed = (queued - 1) * Buffer::size + std::min<uint64_t>(write_index.load(std::memory_order_relaxed), Buffer::size);
+            return claimed > read_index ? claimed - read_index : 0;
         }
 
         bool pop(LogLine& logline) override{
@@ -414,131 +1514,2669 @@ namespace slog{
                 if(read_index == Buffer::size){
                     read_index = 0;
                     r_cursor = nullptr;
-                    SpinLock spinlock(flag);
-                    buffers.pop();
+                    recycle_buffer(rcursor);
                 }
                 return true;
             }
             return false;
         }
 
+        uint64_t dropped() const override{
+            return dropped_count.load(std::memory_order_relaxed);
+        }
+
         QueueBuffer(const QueueBuffer&) = delete;
         QueueBuffer& operator=(const QueueBuffer&) = delete;
         // disable copy constructor
         
     private:
-        std::queue<std::unique_ptr<Buffer>>buffers;
+        const Config config;
+        Parker producer_parker;     // producers waiting for a fresh buffer
+        std::vector<std::unique_ptr<Buffer>>pool;   // owns every buffer, never grows after init
+        std::vector<Buffer*>free_buffers;
+        std::deque<Buffer*>buffers; // queued for reading, back() is being written
         std::atomic<Buffer*>w_cursor;   //current write buffer
         Buffer* r_cursor;    //current read buffer
         std::atomic<unsigned int>write_index;
         unsigned int read_index;
         std::atomic_flag flag;
+        std::atomic<bool>starved{false};    // pool exhausted, the consumer installs the next free buffer
+        std::atomic<uint64_t>dropped_count{0};
 
         void create_buffer(){
-            std::unique_ptr<Buffer>next_wbuffer(new Buffer());
-            w_cursor.store(next_wbuffer.get(), std::memory_order_release);
+            Buffer* next_wbuffer = nullptr;
+            SpinLock spinlock(flag);
+            if(!free_buffers.empty()){
+                next_wbuffer = free_buffers.back();
+                free_buffers.pop_back();
+            }else if(config.overflow == OverflowPolicy::OVERWRITE_OLDEST && buffers.size() > 2){
+                // front() may be under the reader and back() was just filled, steal the one after front()
+                next_wbuffer = buffers[1];
+                buffers.erase(buffers.begin() + 1);
+                next_wbuffer -> clear();
+                dropped_count.fetch_add(Buffer::size, std::memory_order_relaxed);
+            }else{
+                starved.store(true, std::memory_order_release);
+                return;
+            }
+            install_buffer(next_wbuffer);
+        }
+
+        void install_buffer(Buffer* next_wbuffer){
+            // called with the spinlock held
+            w_cursor.store(next_wbuffer, std::memory_order_release);
+            buffers.push_back(next_wbuffer);
+            write_index.store(0, std::memory_order_release);
+            producer_parker.unpark();
+        }
+
+        void recycle_buffer(Buffer* rbuffer){
+            rbuffer -> clear();
             SpinLock spinlock(flag);
-            buffers.push(std::move(next_wbuffer));
-            write_index.store(0, std::memory_order_relaxed);
+            buffers.pop_front();
+            if(starved.load(std::memory_order_acquire)){
+                starved.store(false, std::memory_order_release);
+                install_buffer(rbuffer);
+            }else{
+                free_buffers.push_back(rbuffer);
+            }
         }
 
         Buffer* get_rbuffer(){
             SpinLock spinlock(flag);
-            return buffers.empty() ? nullptr : buffers.front().get();
+            return buffers.empty() ? nullptr : buffers.front();
         }
     };
 
-    class FileWriter{
+    class ThreadRing{
     public:
-        FileWriter(const std::string& dir, const std::string& filename, uint32_t roll_size)
-          : roll_bytes(roll_size * 1024 * 1024),
-          path(dir + filename){
-            roll();
+        explicit ThreadRing(size_t capacity)
+          : mask(capacity - 1),
+          slots(static_cast<LogLine*>(std::malloc(capacity * sizeof(LogLine)))){
+            memset(static_cast<void*>(slots), 0, capacity * sizeof(LogLine));
         }
 
-        void write(LogLine& logline){
-            auto w_pos = s -> tellp();
-            logline.stream_to_string(*s);
-            bytes_written += s -> tellp() - w_pos;
-            if(bytes_written > roll_bytes)  roll();
+        ~ThreadRing(){
+            for(size_t r = read_pos.load(); r != write_pos.load(); r++)    slots[r & mask].~LogLine();
+            std::free(slots);
+        }
+
+        bool push(LogLine&& logline){
+            // owner thread only
+            const size_t w = write_pos.load(std::memory_order_relaxed);
+            if(w - cached_read > mask){
+                cached_read = read_pos.load(std::memory_order_acquire);
+                if(w - cached_read > mask)   return false;
+            }
+            new(&slots[w & mask]) LogLine(std::move(logline));
+            write_pos.store(w + 1, std::memory_order_release);
+            return true;
+        }
+
+        LogLine* front(){
+            // consumer only
+            const size_t r = read_pos.load(std::memory_order_relaxed);
+            if(r == cached_write){
+                cached_write = write_pos.load(std::memory_order_acquire);
+                if(r == cached_write)   return nullptr;
+            }
+            return &slots[r & mask];
+        }
+
+        void pop(){
+            const size_t r = read_pos.load(std::memory_order_relaxed);
+            slots[r & mask].~LogLine();
+            read_pos.store(r + 1, std::memory_order_release);
+        }
+
+        size_t size() const{
+            return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_relaxed);
+        }   // consumer only
+
+        void retire(){
+            retired.store(true, std::memory_order_release);
+        }
+
+        bool is_retired() const{
+            return retired.load(std::memory_order_acquire);
         }
 
+        ThreadRing(const ThreadRing&) = delete;
+        ThreadRing& operator=(const ThreadRing&) = delete;
+
     private:
-        const uint32_t roll_bytes;
-        const std::string path;
-        std::unique_ptr<std::ofstream>s;
-        std::streamoff bytes_written = 0;
-        uint32_t file_index = 0;
+        const size_t mask;
+        LogLine* slots;
+        alignas(64) std::atomic<size_t>write_pos{0};
+        size_t cached_read = 0;     // producer's view of read_pos
+        alignas(64) std::atomic<size_t>read_pos{0};
+        size_t cached_write = 0;    // consumer's view of write_pos
+        alignas(64) std::atomic<bool>retired{false};
+    };
+
+    class ThreadQueueBuffer : public BufferBase{
+    public:
+        explicit ThreadQueueBuffer(const Config& config)
+          : config(config),
+          ring_size(round_up_pow2(std::max(64u, config.thread_ring_size))),
+          id(next_id.fetch_add(1, std::memory_order_relaxed)),
+          flag{ATOMIC_FLAG_INIT}{}
 
-        void roll(){
-            if(s){
-                s -> flush();
-                s -> close();
+        bool push(LogLine&& logline) override{
+            ThreadRing* ring = local_ring();
+            if(ring -> push(std::move(logline)))   return true;
+            if(config.overflow != OverflowPolicy::BLOCK){
+                // the consumer owns the oldest slots of an SPSC ring, so OVERWRITE_OLDEST drops too
+                dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            Waiter waiter(config.producer_wait, config, &producer_parker);
+            Stall stall;
+            while(!ring -> push(std::move(logline))){
+                waiter.wait([]{return false;});
             }
+            return true;
+        }
 
-            bytes_written = 0;
-            s.reset(new std::ofstream());
+        bool pop(LogLine& logline) override{
+            refresh_rings();
+            ThreadRing* oldest = nullptr;
+            slogtime::timestamp_t oldest_ts = 0;
+            bool has_retired = false;
+            for(auto& ring : readers){
+                LogLine* head = ring -> front();
+                if(head == nullptr){
+                    has_retired |= ring -> is_retired();
+                    continue;
+                }
+                const slogtime::timestamp_t ts = head -> timestamp();
+                if(oldest == nullptr || ts < oldest_ts){
+                    oldest = ring.get();
+                    oldest_ts = ts;
+                }
+            }
+            if(has_retired) reap_rings();
+            if(oldest == nullptr)   return false;
+            logline = std::move(*oldest -> front());
+            oldest -> pop();
+            producer_parker.unpark();
+            return true;
+        }
+
+        bool empty() override{
+            refresh_rings();
+            for(auto& ring : readers){
+                if(ring -> front() != nullptr)  return false;
+            }
+            return true;
+        }
+
+        uint64_t depth() override{
+            uint64_t n = 0;
+            for(auto& ring : readers)   n += ring -> size();
+            return n;
+        }
+
+        uint64_t dropped() const override{
+            return dropped_count.load(std::memory_order_relaxed);
+        }
+
+        ThreadQueueBuffer(const ThreadQueueBuffer&) = delete;
+        ThreadQueueBuffer& operator=(const ThreadQueueBuffer&) = delete;
+
+    private:
+        struct LocalRings{
+            std::vector<std::pair<uint64_t, std::shared_ptr<ThreadRing>>>rings;    // queue id, ring
+
+            ~LocalRings(){
+                for(auto& ring : rings) ring.second -> retire();
+            }   // thread exit, the consumer drains and drops the rings
+        };
+
+        static std::atomic<uint64_t>next_id;
+        const Config config;
+        const size_t ring_size;
+        const uint64_t id;
+        Parker producer_parker;     // producers waiting on a full ring
+        std::vector<std::shared_ptr<ThreadRing>>rings;  // registry, guarded by flag
+        std::atomic<uint64_t>rings_version{0};
+        std::atomic_flag flag;
+        std::vector<std::shared_ptr<ThreadRing>>readers;    // consumer's snapshot of rings
+        uint64_t readers_version = 0;
+        std::atomic<uint64_t>dropped_count{0};
+
+        static size_t round_up_pow2(size_t n){
+            size_t p = 1;
+            while(p < n)    p <<= 1;
+            return p;
+        }
+
+        ThreadRing* local_ring(){
+            static thread_local LocalRings local;
+            static thread_local uint64_t last_id = 0;
+            static thread_local ThreadRing* last_ring = nullptr;
+            if(last_ring != nullptr && last_id == id)   return last_ring;
+            for(auto& ring : local.rings){
+                if(ring.first == id){
+                    last_id = id;
+                    return last_ring = ring.second.get();
+                }
+            }
+            local.rings.erase(std::remove_if(local.rings.begin(), local.rings.end(),
+                [](const std::pair<uint64_t, std::shared_ptr<ThreadRing>>& ring){return ring.second.use_count() == 1;}),
+                local.rings.end());    // rings whose queue is gone
+            std::shared_ptr<ThreadRing>ring(new ThreadRing(ring_size));
+            {
+                SpinLock spinlock(flag);
+                rings.push_back(ring);
+                rings_version.fetch_add(1, std::memory_order_release);
+            }
+            local.rings.emplace_back(id, ring);
+            last_id = id;
+            return last_ring = ring.get();
+        }
+
+        void refresh_rings(){
+            const uint64_t version = rings_version.load(std::memory_order_acquire);
+            if(version == readers_version)  return;
+            SpinLock spinlock(flag);
+            readers = rings;
+            readers_version = rings_version.load(std::memory_order_relaxed);
+        }
 
-            std::filesystem::path log_file = path;
-            log_file += ".";
-            log_file += std::to_string(++file_index);
-            log_file += ".txt";
-	        s -> open(log_file);
+        void reap_rings(){
+            // a retired ring never gets new records, drop it once it is drained
+            auto drained = [](const std::shared_ptr<ThreadRing>& ring){
+                return ring -> is_retired() && ring -> front() == nullptr;
+            };
+            SpinLock spinlock(flag);
+            rings.erase(std::remove_if(rings.begin(), rings.end(), drained), rings.end());
+            readers = rings;
+            readers_version = rings_version.fetch_add(1, std::memory_order_release) + 1;
         }
     };
 
-    class Logger{
+    std::atomic<uint64_t>ThreadQueueBuffer::next_id{1};
+
+    class ByteRingBuffer : public BufferBase, CallSiteObserver{
     public:
-        Logger(const std::string& dir, const std::string& filename, uint32_t roll_size)
-          : state(State::INIT),
-          buffer_queue(new QueueBuffer()),
-          file_writer(dir, filename, std::max(1u, roll_size)),
-          thread(&Logger::pop, this){
-            state.store(State::ENABLED, std::memory_order_release);
+        explicit ByteRingBuffer(const Config& config)
+          : config(config),
+          capacity(round_up_pow2(std::max<size_t>(64 * 1024, static_cast<size_t>(config.byte_ring_kb) * 1024))),
+          mask(capacity - 1){
+            if(!config.ring_file.empty())   map_file(config.ring_file);
+            if(ring == nullptr){
+                ring = static_cast<char*>(std::malloc(capacity));
+                control = &local_control;
+            }
+            memset(ring, 0xff, capacity);   // pre-fault, and no stamp matches a position yet
+            if(file_header != nullptr)  add_observer(this);
         }
-        
-        ~Logger(){
-            state.store(State::DISABLED);
-            thread.join();
+
+        ~ByteRingBuffer(){
+            // records logged after the consumer stopped, only the heap copies need freeing
+            for(const Header* entry = front(); entry != nullptr; entry = front()){
+                if(entry -> kind == HEAP){
+                    HeapRecord* heap;
+                    memcpy(&heap, entry + 1, sizeof(heap));
+                    std::free(heap);
+                }
+                read_pos += align(sizeof(Header) + entry -> size);
+            }
+            if(file_header == nullptr){
+                std::free(ring);
+                return;
+            }
+            remove_observer(this);
+            // everything was written out; unlinked before the lock goes with the close
+            struct stat ours, current;
+            if(::fstat(fd, &ours) == 0 && ::stat(config.ring_file.c_str(), &current) == 0
+                && ours.st_ino == current.st_ino && ours.st_dev == current.st_dev)  ::unlink(config.ring_file.c_str());
+            ::munmap(file_header, map_size);
+            ::close(fd);
         }
 
-        void add(LogLine&& logline){
-            buffer_queue -> push(std::move(logline));
+        bool push(LogLine&& logline) override{
+            char* record = reserve(size(logline));
+            if(record == nullptr)   return false;
+            memcpy(record, data(logline), size(logline));
+            commit(record);
+            return true;
         }
 
-        void pop(){
-            while(state.load(std::memory_order_acquire) == State::INIT);
-            // wait until constructor is finished
-            LogLine logline(LogSeverity::INFO, nullptr, nullptr, 0);
-            while(state.load(std::memory_order_seq_cst) == State::ENABLED){
-                if(buffer_queue -> pop(logline))    file_writer.write(logline);
+        char* reserve(size_t bytes) override{
+            if(align(sizeof(Header) + bytes) <= capacity / 4){
+                Header* entry = claim(bytes, RECORD);
+                return entry == nullptr ? nullptr : reinterpret_cast<char*>(entry + 1);
             }
-            // read remaining log
-            while(buffer_queue -> pop(logline)) file_writer.write(logline);
+            // too long for the ring: the entry holds the address of a heap copy, as a LogLine
+            // does past its stack buffer; not recovered after a crash
+            HeapRecord* heap = static_cast<HeapRecord*>(std::malloc(sizeof(HeapRecord) + bytes));
+            if(heap == nullptr){
+                dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            Header* entry = claim(sizeof(heap), HEAP);
+            if(entry == nullptr){
+                std::free(heap);
+                return nullptr;
+            }
+            count(stat_shard().heap_allocations);
+            heap -> entry = entry;
+            heap -> size = bytes;
+            memcpy(reinterpret_cast<char*>(entry + 1), &heap, sizeof(heap));
+            return reinterpret_cast<char*>(heap + 1);
         }
-          
+
+        void commit(char* record) override{
+            Header* entry = record >= ring && record < ring + capacity
+                ? reinterpret_cast<Header*>(record) - 1 : (reinterpret_cast<HeapRecord*>(record) - 1) -> entry;
+            entry -> stamp.store(entry -> stamp.load(std::memory_order_relaxed) & ~PENDING, std::memory_order_release);
+        }
+
+        bool pop(LogLine& logline) override{
+            const Header* entry = front();
+            if(entry == nullptr)    return false;
+            if(entry -> kind == HEAP){
+                HeapRecord* heap;
+                memcpy(&heap, entry + 1, sizeof(heap));
+                assign(logline, reinterpret_cast<const char*>(heap + 1), heap -> size);
+                std::free(heap);
+            }else{
+                assign(logline, reinterpret_cast<const char*>(entry + 1), entry -> size);
+            }
+            read_pos += align(sizeof(Header) + entry -> size);
+            ++popped;
+            if(file_header == nullptr)  release();
+            return true;
+        }
+
+        bool empty() override{
+            return front() == nullptr;
+        }
+
+        uint64_t depth() override{
+            uint64_t records = 0;
+            for(const ReservedShard& shard : reserved)  records += shard.records.load(std::memory_order_relaxed);
+            return records > popped ? records - popped : 0;
+        }
+
+        uint64_t dropped() const override{
+            return dropped_count.load(std::memory_order_relaxed);
+        }
+
+        void release() override{
+            // a file-backed ring only frees entries here, so the file always covers unwritten records
+            free_consumed();
+            producer_parker.unpark();
+        }
+
+        bool keeps() const noexcept override{
+            return file_header != nullptr;
+        }
+
+        // records left in a ring_file by a process that died, in ring order;
+        // site pointers are rewritten to call sites rebuilt from the file's table
+        static uint64_t recover(const std::string& path, const std::function<void(LogLine&)>& fn){
+            const int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(in < 0)  return 0;
+            struct stat st;
+            void* map = ::fstat(in, &st) == 0 && static_cast<size_t>(st.st_size) >= ring_offset
+                ? ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, in, 0) : MAP_FAILED;
+            ::close(in);
+            if(map == MAP_FAILED)   return 0;
+            const FileHeader* file = static_cast<const FileHeader*>(map);
+            const uint64_t capacity = file -> capacity;
+            if(memcmp(file -> magic, magic, sizeof(magic)) != 0 || file -> version != version
+                || file -> thread_id_size != sizeof(std::thread::id) || file -> type_count != std::tuple_size<LogLine::DataTypes>::value
+                || capacity == 0 || (capacity & (capacity - 1)) != 0 || ring_offset + capacity > static_cast<uint64_t>(st.st_size)){
+                ::munmap(map, st.st_size);
+                return 0;
+            }
+
+            std::unordered_map<uint64_t, const CallSite*>sites;
+            std::deque<CallSite>site_storage;
+            std::deque<std::string>strings;
+            std::deque<std::vector<uint8_t>>types;
+            const char* cursor = static_cast<const char*>(map) + table_offset;
+            const char* const table_end = cursor + std::min<uint64_t>(file -> table_used.load(std::memory_order_relaxed), table_size);
+            while(static_cast<size_t>(table_end - cursor) >= sizeof(SiteEntry)){
+                SiteEntry site;
+                memcpy(&site, cursor, sizeof(site));
+                if(site.size < sizeof(site) + site.arg_count + 3 || site.size > static_cast<size_t>(table_end - cursor))  break;
+                const char* const next = cursor + site.size;
+                const uint8_t* arg_types = reinterpret_cast<const uint8_t*>(cursor + sizeof(site));
+                const char* p = cursor + sizeof(site) + site.arg_count;
+                const char* text[3] = {};
+                for(const char*& s : text){
+                    const char* nul = static_cast<const char*>(memchr(p, '\0', next - p));
+                    if(nul == nullptr)  break;
+                    s = strings.emplace_back(p, nul).c_str();
+                    p = nul + 1;
+                }
+                if(text[2] == nullptr)  break;
+                types.emplace_back(arg_types, arg_types + site.arg_count);
+                sites[site.address] = &site_storage.emplace_back(text[0], text[1], site.line, static_cast<LogSeverity>(site.level),
+                    site.has_format ? text[2] : nullptr, types.back().data(), site.arg_count, false);
+                cursor = next;
+            }
+
+            const size_t record_header = sizeof(slogtime::timestamp_t) + sizeof(std::thread::id) + sizeof(const CallSite*);
+            char* const ring = static_cast<char*>(map) + ring_offset;
+            LogLine logline(nullptr);
+            uint64_t count = 0;
+            const uint64_t head = file -> control.head.load(std::memory_order_relaxed);
+            for(uint64_t pos = file -> control.tail.load(std::memory_order_relaxed); pos < head;){
+                Header* entry = reinterpret_cast<Header*>(ring + (pos & (capacity - 1)));
+                const uint64_t stamp = entry -> stamp.load(std::memory_order_relaxed);
+                // reserved but never stamped: nothing after it can be trusted to be in order
+                if((stamp & ~PENDING) != pos || entry -> size > capacity)   break;
+                const uint64_t at = pos;
+                pos += entry -> kind == PAD ? entry -> size : align(sizeof(Header) + entry -> size);
+                // a producer that died between reserve and commit left a partial record
+                if(entry -> kind != RECORD || stamp != at || entry -> size < record_header)   continue;   // HEAP: gone with the process
+                char* record = reinterpret_cast<char*>(entry + 1);
+                uint64_t address;
+                memcpy(&address, record + record_header - sizeof(const CallSite*), sizeof(address));
+                auto it = sites.find(address);
+                if(it == sites.end())   continue;   // flush markers, or a site the table had no room for
+                memcpy(record + record_header - sizeof(const CallSite*), &it -> second, sizeof(const CallSite*));
+                assign(logline, record, entry -> size);
+                fn(logline);
+                count++;
+            }
+            ::munmap(map, st.st_size);
+            return count;
+        }
+
+        ByteRingBuffer(const ByteRingBuffer&) = delete;
+        ByteRingBuffer& operator=(const ByteRingBuffer&) = delete;
+
     private:
-        enum class State{
-            INIT,
-            ENABLED,
-            DISABLED,
+        // an entry is ready once its stamp equals its absolute ring position;
+        // positions are multiples of 16, so a set low bit marks one in progress
+        struct Header{
+            std::atomic<uint64_t>stamp;
+            uint32_t size;
+            uint32_t kind;
         };
-        std::atomic<State>state;
-        std::unique_ptr<BufferBase>buffer_queue;
-        FileWriter file_writer;
-        std::thread thread;
+        static_assert(sizeof(Header) == 16);
+        static constexpr const uint32_t RECORD = 0;
+        static constexpr const uint32_t PAD = 1;
+        static constexpr const uint32_t HEAP = 2;     // the entry holds a HeapRecord*
+
+        // a record over a quarter of the ring, followed by its bytes
+        struct HeapRecord{
+            Header* entry;
+            uint64_t size;
+        };
+        static_assert(sizeof(HeapRecord) == 16);
+        static constexpr const uint64_t PENDING = 1;
+
+        struct Control{
+            alignas(64) std::atomic<uint64_t>head{0};   // next position to reserve
+            alignas(64) std::atomic<uint64_t>tail{0};   // consumed up to here
+        };
+
+        // ring_file layout: this header, the call-site table, then the ring
+        struct FileHeader{
+            char magic[8];
+            uint32_t version;
+            uint32_t thread_id_size;
+            uint32_t type_count;
+            uint64_t capacity;
+            std::atomic<uint64_t>table_used;
+            Control control;
+        };
+        static_assert(sizeof(FileHeader) <= 4096);
+
+        // a table entry, followed by arg_count type ids and the file, func and format strings
+        #pragma pack(push, 1)
+        struct SiteEntry{
+            uint32_t size;
+            uint64_t address;
+            uint32_t line;
+            uint8_t level;
+            uint8_t has_format;
+            uint8_t arg_count;
+        };
+        #pragma pack(pop)
+
+        static constexpr const char magic[8] = {'S', 'L', 'O', 'G', 'R', 'I', 'N', 'G'};
+        static constexpr const uint32_t version = 1;
+        static constexpr const size_t table_offset = 4096;
+        static constexpr const size_t table_size = 1 << 20;
+        static constexpr const size_t ring_offset = table_offset + table_size;
+
+        const Config config;
+        const size_t capacity;
+        const uint64_t mask;
+        char* ring = nullptr;
+        Control local_control;
+        Control* control = nullptr;
+        FileHeader* file_header = nullptr;  // ring_file only
+        int fd = -1;
+        size_t map_size = 0;
+        std::unordered_set<const CallSite*>recorded;    // sites already in the table
+        Parker producer_parker;     // producers waiting for room
+        uint64_t read_pos = 0;      // consumer's copy of tail
+        uint64_t freed = 0;         // tail as last stored, poisoned below it
+        uint64_t popped = 0;        // records, for depth()
+        struct alignas(64) ReservedShard{
+            std::atomic<uint64_t>records{0};
+        } reserved[stat_shard_count];   // by the producer's stat shard, a shared counter would be a second contended line
+        std::atomic<uint64_t>dropped_count{0};
+
+        static uint64_t align(uint64_t n){
+            return (n + 15) & ~static_cast<uint64_t>(15);
+        }
+
+        static size_t round_up_pow2(size_t n){
+            size_t p = 1;
+            while(p < n)    p <<= 1;
+            return p;
+        }
+
+        static int lock_file(const std::string& path){
+            // the ring's owner holds an flock on it until it is gone, so a ring whose lock can be
+            // taken was left by a dead process: it is kept for Logger to recover. -1 if a live
+            // logger, of this process or another, owns the path
+            for(;;){
+                const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+                if(fd < 0)  return -1;
+                if(::flock(fd, LOCK_EX | LOCK_NB) != 0){
+                    ::close(fd);
+                    return -1;
+                }
+                // the path may have been renamed or unlinked between open and flock
+                struct stat locked, current;
+                const bool same = ::fstat(fd, &locked) == 0 && ::stat(path.c_str(), &current) == 0
+                    && locked.st_ino == current.st_ino && locked.st_dev == current.st_dev;
+                if(same && locked.st_size == 0) return fd;
+                const bool moved = same && ::rename(path.c_str(), (path + ".crashed").c_str()) == 0;
+                ::close(fd);
+                if(same && !moved)  return -1;
+            }
+        }
+
+        void map_file(const std::string& path){
+            // on failure the ring stays on the heap, without crash recovery
+            fd = lock_file(path);
+            if(fd < 0)  return;
+            const size_t size = ring_offset + capacity;
+            void* map = ::ftruncate(fd, static_cast<off_t>(size)) == 0
+                ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if(map == MAP_FAILED){
+                ::unlink(path.c_str());
+                ::close(fd);
+                fd = -1;
+                return;
+            }
+            map_size = size;
+            file_header = new(map) FileHeader{};
+            memcpy(file_header -> magic, magic, sizeof(magic));
+            file_header -> version = version;
+            file_header -> thread_id_size = sizeof(std::thread::id);
+            file_header -> type_count = std::tuple_size<LogLine::DataTypes>::value;
+            file_header -> capacity = capacity;
+            control = &file_header -> control;
+            ring = static_cast<char*>(map) + ring_offset;
+        }
+
+        void on_call_site(const CallSite& site) override{
+            if(!recorded.insert(&site).second)  return;
+            const char* const format = site.format() != nullptr ? site.format() : "";
+            const size_t file_len = strlen(site.file()) + 1;
+            const size_t func_len = strlen(site.func()) + 1;
+            const size_t format_len = strlen(format) + 1;
+            SiteEntry entry;
+            entry.size = static_cast<uint32_t>(sizeof(entry) + site.arg_count() + file_len + func_len + format_len);
+            const uint64_t used = file_header -> table_used.load(std::memory_order_relaxed);
+            if(used + entry.size > table_size)  return;     // full, records of this site are not recovered
+            entry.address = reinterpret_cast<uintptr_t>(&site);
+            entry.line = site.line();
+            entry.level = static_cast<uint8_t>(site.level());
+            entry.has_format = site.format() != nullptr;
+            entry.arg_count = site.arg_count();
+            char* p = reinterpret_cast<char*>(file_header) + table_offset + used;
+            memcpy(p, &entry, sizeof(entry));
+            p += sizeof(entry);
+            if(site.arg_count() != 0)   memcpy(p, site.arg_types(), site.arg_count());     // nullptr for streams
+            p += site.arg_count();
+            memcpy(p, site.file(), file_len);
+            memcpy(p + file_len, site.func(), func_len);
+            memcpy(p + file_len + func_len, format, format_len);
+            file_header -> table_used.store(used + entry.size, std::memory_order_release);
+        }
+
+        Header* header(uint64_t pos) const{
+            return reinterpret_cast<Header*>(ring + (pos & mask));
+        }
+
+        const Header* front(){
+            // consumer only, steps over pad entries
+            for(;;){
+                const Header* entry = header(read_pos);
+                if(entry -> stamp.load(std::memory_order_acquire) != read_pos) return nullptr;
+                // no entry spans more than this, as recover() also checks; anything else is not one
+                if(entry -> kind == PAD ? entry -> size > capacity : align(sizeof(Header) + entry -> size) > capacity / 4)  return nullptr;
+                if(entry -> kind != PAD)    return entry;
+                read_pos += entry -> size;
+                if(file_header == nullptr)  free_consumed();
+            }
+        }
+
+        Header* claim(size_t bytes, uint32_t kind){
+            // an entry of bytes in the ring, stamped in progress; nullptr if the record is dropped
+            const uint64_t need = align(sizeof(Header) + bytes);
+            uint64_t pos = control -> head.load(std::memory_order_relaxed);
+            uint64_t pad;
+            for(;;){
+                // an entry never wraps, the tail end of the ring is skipped with a pad entry
+                pad = (pos & mask) + need > capacity ? capacity - (pos & mask) : 0;
+                // pos may be stale and behind tail, so compare without subtracting
+                if(pos + pad + need > control -> tail.load(std::memory_order_acquire) + capacity){
+                    if(config.overflow != OverflowPolicy::BLOCK){
+                        dropped_count.fetch_add(1, std::memory_order_relaxed);
+                        return nullptr;
+                    }
+                    wait_for_room(pos + pad + need);
+                    pos = control -> head.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if(control -> head.compare_exchange_weak(pos, pos + pad + need, std::memory_order_relaxed))  break;
+            }
+            count(reserved[&stat_shard() - stat_shards].records);
+            if(pad != 0){
+                Header* filler = header(pos);
+                filler -> size = static_cast<uint32_t>(pad);
+                filler -> kind = PAD;
+                filler -> stamp.store(pos, std::memory_order_release);
+                pos += pad;
+            }
+            Header* entry = header(pos);
+            entry -> size = static_cast<uint32_t>(bytes);
+            entry -> kind = kind;
+            entry -> stamp.store(pos | PENDING, std::memory_order_relaxed);
+            return entry;
+        }
+
+        void free_consumed(){
+            // stale bytes a producer has not yet stamped over must not read as a stamp: between its
+            // CAS on head and its stamp store, front() sees whatever the last lap left, payload included
+            for(uint64_t pos = freed; pos < read_pos;){
+                const uint64_t n = std::min(read_pos - pos, capacity - (pos & mask));
+                memset(ring + (pos & mask), 0xff, n);
+                pos += n;
+            }
+            freed = read_pos;
+            control -> tail.store(read_pos, std::memory_order_release);
+        }
+
+        void wait_for_room(uint64_t end){
+            Waiter waiter(config.producer_wait, config, &producer_parker);
+            auto ready = [this, end]{return end <= control -> tail.load(std::memory_order_acquire) + capacity;};
+            Stall stall;
+            while(!ready()) waiter.wait(ready);
+        }
     };
 
-    std::unique_ptr<Logger>logger;
-    std::atomic<Logger*>atomic_logger;
+    BufferBase* create_queue(const Config& config){
+        if(config.queue_mode == QueueMode::PER_THREAD)  return new ThreadQueueBuffer(config);
+        if(config.queue_mode == QueueMode::BYTE_RING)   return new ByteRingBuffer(config);
+        return new QueueBuffer(config);
+    }
 
-    bool Slog::operator+=(LogLine& logline){
-        atomic_logger.load(std::memory_order_acquire) -> add(std::move(logline));
+    struct LogFile{
+        int fd = -1;
+        char* map = nullptr;    // MMAP sink only, nullptr if mapping failed
+        uint64_t map_size = 0;
+        uint64_t length = 0;    // bytes written
+        std::string path;       // for Config::recompress_level
+    };
+
+    LogFile open_log(const std::string& path, uint64_t reserve, bool mapped){
+        LogFile file;
+        file.path = path;
+        file.fd = ::open(path.c_str(), (mapped ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(file.fd < 0 || reserve == 0) return file;
+        if(!mapped){
+        #ifdef FALLOC_FL_KEEP_SIZE
+            // blocks for a whole file up front, the size still grows with what is written
+            ::fallocate(file.fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(reserve));
+        #endif
+            return file;
+        }
+        // real blocks rather than a sparse file, so a full disk fails here instead of SIGBUS later
+        if(::posix_fallocate(file.fd, 0, static_cast<off_t>(reserve)) != 0 && ::ftruncate(file.fd, static_cast<off_t>(reserve)) != 0)   return file;
+        void* map = ::mmap(nullptr, reserve, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+        if(map == MAP_FAILED)   return file;
+        ::madvise(map, reserve, MADV_SEQUENTIAL);
+        file.map = static_cast<char*>(map);
+        file.map_size = reserve;
+        return file;
+    }
+
+    void close_log(const LogFile& file){
+        if(file.map != nullptr) ::munmap(file.map, file.map_size);
+        ::ftruncate(file.fd, static_cast<off_t>(file.length));    // mapped size or preallocated blocks past the end
+        ::fsync(file.fd);
+        ::close(file.fd);
+    }
+
+    bool write_all(int fd, const char* data, size_t len){
+        while(len > 0){
+            const ssize_t n = ::write(fd, data, len);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0)  return false;
+            data += n;
+            len -= n;
+        }
         return true;
     }
 
-    void init(const std::string& dir, const std::string filename, uint32_t roll_size){
-        logger.reset(new Logger(dir, filename, roll_size));
-        atomic_logger.store(logger.get(), std::memory_order_seq_cst);
+    void put_lz_header(ByteBuffer& out, OutputFormat format){
+        LzFileHeader header{};
+        memcpy(header.magic, lz_magic, sizeof(lz_magic));
+        header.version = lz_version;
+        header.format = static_cast<uint8_t>(format);
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    // appends data as LzBlocks of at most block_bytes, ended at the last '\n'
+    // that fits when lines is set; raw_offset advances past it
+    void put_lz_blocks(ByteBuffer& out, const char* data, size_t n, uint64_t& raw_offset, size_t block_bytes, bool lines, int level){
+        while(n != 0){
+            size_t size = std::min(n, block_bytes);
+            if(lines && size < n){
+                const char* nl = static_cast<const char*>(memrchr(data, '\n', size));
+                if(nl != nullptr)   size = nl - data + 1;   // else a line longer than a block, cut anywhere
+            }
+            LzBlock block;
+            block.raw_offset = raw_offset;
+            block.raw_bytes = static_cast<uint32_t>(size);
+            char* b = out.reserve(sizeof(block) + lz_bound(size));
+            size_t packed = lz_compress(data, size, b + sizeof(block), level);
+            if(packed >= size){
+                memcpy(b + sizeof(block), data, size);
+                packed = size;
+                block.packed_bytes = static_cast<uint32_t>(size) | lz_stored;
+            }else{
+                block.packed_bytes = static_cast<uint32_t>(packed);
+            }
+            memcpy(b, &block, sizeof(block));
+            out.commit(sizeof(block) + packed);
+            raw_offset += size;
+            data += size;
+            n -= size;
+        }
     }
-}
\ No newline at end of file
+
+    // Config::compress_level: FileBuffer hands over each full buffer, which is
+    // cut into blocks, compressed and written here, so the consumer only waits
+    // when the previous buffer is still in flight, on flush and on a roll
+    class BlockCompressor{
+    public:
+        BlockCompressor(int level, size_t block_bytes, OutputFormat format)
+          : level(level), block_bytes(block_bytes), format(format), thread(&BlockCompressor::run, this){}
+
+        ~BlockCompressor(){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();      // what is queued still goes out
+        }
+
+        // the next file, nothing in flight: writes its header, returns its length
+        uint64_t begin(int next){
+            std::lock_guard<std::mutex>lock(mutex);
+            fd = next;
+            raw_offset = 0;
+            packed.clear();
+            put_lz_header(packed, format);
+            length = write_all(fd, packed.data(), packed.size()) ? packed.size() : 0;
+            count(consumer_stats.compressed, length);
+            return length;
+        }
+
+        void push(ByteBuffer& out){
+            // takes out's bytes and leaves it empty
+            std::unique_lock<std::mutex>lock(mutex);
+            idle.wait(lock, [this]{return queued.size() == 0;});
+            queued.swap(out);
+            cv.notify_one();
+        }
+
+        uint64_t wait(){
+            // everything pushed so far is written; the length of the file
+            std::unique_lock<std::mutex>lock(mutex);
+            idle.wait(lock, [this]{return queued.size() == 0 && !busy;});
+            return length;
+        }
+
+        BlockCompressor(const BlockCompressor&) = delete;
+        BlockCompressor& operator=(const BlockCompressor&) = delete;
+
+    private:
+        const int level;
+        const size_t block_bytes;
+        const OutputFormat format;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable idle;
+        ByteBuffer queued;
+        ByteBuffer taken;
+        ByteBuffer packed;
+        bool busy = false;
+        bool stopping = false;
+        int fd = -1;
+        uint64_t raw_offset = 0;
+        uint64_t length = 0;
+        std::thread thread;
+
+        void run(){
+            std::unique_lock<std::mutex>lock(mutex);
+            for(;;){
+                cv.wait(lock, [this]{return stopping || queued.size() != 0;});
+                if(queued.size() == 0)  return;
+                taken.swap(queued);
+                busy = true;
+                idle.notify_all();      // room for the next buffer while this one compresses
+                lock.unlock();
+
+                packed.clear();
+                put_lz_blocks(packed, taken.data(), taken.size(), raw_offset, block_bytes, format != OutputFormat::BINARY, level);
+                const bool ok = write_all(fd, packed.data(), packed.size());
+                if(ok)  count(consumer_stats.compressed, packed.size());
+                taken.clear();
+
+                lock.lock();
+                if(ok)  length += packed.size();    // else nowhere to report to, as with a failed write(2)
+                busy = false;
+                idle.notify_all();
+            }
+        }
+    };
+
+    // Config::recompress_level: rolled files are rewritten at that level on a
+    // thread of their own, block for block, so raw offsets and a path.N.idx
+    // still hold. A plain file becomes path.lz. A file still queued at
+    // shutdown is left as it is
+    class Recompressor{
+    public:
+        Recompressor(int level, size_t block_bytes, OutputFormat format)
+          : level(level), block_bytes(block_bytes), format(format), thread(&Recompressor::run, this){}
+
+        ~Recompressor(){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();
+        }
+
+        void add(const std::string& path){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                pending.push_back(path);
+            }
+            cv.notify_one();
+        }
+
+        Recompressor(const Recompressor&) = delete;
+        Recompressor& operator=(const Recompressor&) = delete;
+
+    private:
+        const int level;
+        const size_t block_bytes;
+        const OutputFormat format;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::string>pending;
+        std::atomic<bool>stopping{false};
+        std::thread thread;
+
+        void run(){
+            std::unique_lock<std::mutex>lock(mutex);
+            for(;;){
+                cv.wait(lock, [this]{return stopping || !pending.empty();});
+                if(stopping)    return;
+                const std::string path = pending.front();
+                pending.pop_front();
+                lock.unlock();
+                recompress(path);
+                lock.lock();
+            }
+        }
+
+        void recompress(const std::string& path){
+            std::ifstream in(path, std::ios::binary);
+            const std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            const bool packed = path.size() > 3 && path.compare(path.size() - 3, 3, ".lz") == 0;
+            const bool lines = format != OutputFormat::BINARY;
+            ByteBuffer out(data.size() / 4 + 4096);
+            put_lz_header(out, format);
+            if(!packed){
+                uint64_t raw_offset = 0;
+                for(size_t pos = 0; pos < data.size() && !stopping;){
+                    // sixteen blocks at a time, to notice stopping
+                    size_t end = std::min(data.size(), pos + block_bytes * 16);
+                    if(end < data.size() && lines){
+                        const char* nl = static_cast<const char*>(memrchr(data.data() + pos, '\n', end - pos));
+                        if(nl != nullptr)   end = nl - data.data() + 1;
+                    }
+                    put_lz_blocks(out, data.data() + pos, end - pos, raw_offset, block_bytes, lines, level);
+                    pos = end;
+                }
+            }else{
+                LzFileHeader header;
+                if(data.size() < sizeof(header))    return;
+                memcpy(&header, data.data(), sizeof(header));
+                if(memcmp(header.magic, lz_magic, sizeof(lz_magic)) != 0 || header.version != lz_version)  return;
+                std::unique_ptr<char[]>raw;
+                size_t raw_size = 0;
+                for(size_t pos = sizeof(header); pos + sizeof(LzBlock) <= data.size() && !stopping;){
+                    LzBlock block;
+                    memcpy(&block, data.data() + pos, sizeof(block));
+                    pos += sizeof(block);
+                    const size_t size = block.packed_bytes & ~lz_stored;
+                    if(block.raw_bytes == 0 || size > data.size() - pos)    break;
+                    if(block.raw_bytes > raw_size){
+                        raw_size = block.raw_bytes;
+                        raw.reset(new char[raw_size]);
+                    }
+                    if(!lz_unpack(block, data.data() + pos, raw.get())) break;
+                    uint64_t raw_offset = block.raw_offset;
+                    put_lz_blocks(out, raw.get(), block.raw_bytes, raw_offset, block.raw_bytes, lines, level);
+                    pos += size;
+                }
+            }
+            if(stopping)    return;
+            // a reader with the old file open keeps reading it; the rename swaps in the new one whole
+            const std::string target = packed ? path : path + ".lz";
+            const std::string temp = target + ".tmp";
+            const int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd < 0)  return;
+            const bool ok = write_all(fd, out.data(), out.size()) && ::fsync(fd) == 0;
+            ::close(fd);
+            if(!ok || ::rename(temp.c_str(), target.c_str()) != 0){
+                ::unlink(temp.c_str());
+                return;
+            }
+            if(!packed) ::unlink(path.c_str());
+        }
+    };
+
+    class FileBuffer{
+    public:
+        // owns compressor, nullptr writes the bytes as they are
+        FileBuffer(size_t capacity, std::chrono::milliseconds sync_interval, BlockCompressor* compressor)
+          : out(capacity), threshold(capacity), sync_interval(sync_interval), compressor(compressor){}
+
+        ~FileBuffer(){
+            close();
+        }
+
+        LogFile swap(const LogFile& next){
+            flush();
+            LogFile previous = file;
+            file = next;
+            synced = 0;
+            if(compressor)  file.length = compressor -> begin(file.fd);
+            return previous;
+        }   // buffered bytes go to the old file, the caller disposes of it
+
+        void close(){
+            if(file.fd < 0) return;
+            flush();
+            close_log(file);
+            file = LogFile();
+        }
+
+        ByteBuffer& buffer() noexcept{return out;}
+
+        void commit(){
+            if(out.size() < threshold)  return;
+            if(compressor)  compressor -> push(out);
+            else    flush();
+        }   // after each record: one write(2), mapping copy or compressed batch per full buffer
+
+        void flush(){
+            if(compressor){
+                if(out.size() != 0) compressor -> push(out);
+                file.length = compressor -> wait();
+                return;
+            }
+            if(file.map != nullptr){
+                copy();
+                return;
+            }
+            const char* data = out.data();
+            size_t len = out.size();
+            while(len > 0 && file.fd >= 0){
+                ssize_t n = ::write(file.fd, data, len);
+                if(n < 0){
+                    if(errno == EINTR)  continue;
+                    break;      // nowhere to report to, the bytes are lost
+                }
+                data += n;
+                len -= n;
+                file.length += n;
+            }
+            out.clear();
+        }
+
+        void sync(){
+            // MMAP: start writeback of whole pages copied so far and drop them from this process
+            if(file.map == nullptr) return;
+            last_sync = std::chrono::steady_clock::now();
+            const uint64_t end = file.length & ~static_cast<uint64_t>(page_size - 1);
+            if(end <= synced)   return;
+            ::msync(file.map + synced, end - synced, MS_ASYNC);
+            ::madvise(file.map + synced, end - synced, MADV_DONTNEED);
+            synced = end;
+        }
+
+        void truncate(){
+            // fatal paths: the file ends at what was written even if close() never runs
+            if(file.fd < 0) return;
+            if(file.map != nullptr){
+                // the rest goes through write(2), the mapping would reach past the end
+                ::munmap(file.map, file.map_size);
+                file.map = nullptr;
+                file.map_size = 0;
+                ::lseek(file.fd, static_cast<off_t>(file.length), SEEK_SET);
+            }
+            ::ftruncate(file.fd, static_cast<off_t>(file.length));
+        }
+
+        size_t pending() const noexcept{return out.size();}
+
+        FileBuffer(const FileBuffer&) = delete;
+        FileBuffer& operator=(const FileBuffer&) = delete;
+
+    private:
+        ByteBuffer out;
+        const size_t threshold;
+        const std::chrono::milliseconds sync_interval;
+        const uint64_t page_size = static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        const std::unique_ptr<BlockCompressor>compressor;
+        LogFile file;
+        uint64_t synced = 0;
+        std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now();
+
+        void copy(){
+            const uint64_t need = file.length + out.size();
+            if(need > file.map_size && !grow(need)){
+                out.clear();    // as with a failed write(2)
+                return;
+            }
+            memcpy(file.map + file.length, out.data(), out.size());
+            file.length = need;
+            out.clear();
+            if(std::chrono::steady_clock::now() - last_sync >= sync_interval)   sync();
+        }
+
+        bool grow(uint64_t need){
+            // the record that crosses roll_size may not fit the pre-sized file
+            const uint64_t size = std::max(need, file.map_size + file.map_size / 2);
+            if(::ftruncate(file.fd, static_cast<off_t>(size)) != 0)   return false;
+            void* map = ::mremap(file.map, file.map_size, size, MREMAP_MAYMOVE);
+            if(map == MAP_FAILED)   return false;
+            file.map = static_cast<char*>(map);
+            file.map_size = size;
+            return true;
+        }
+    };
+
+    // opens and preallocates (or maps) the next file and closes finished ones
+    // on a helper thread, so a roll on the consumer is a pointer swap
+    class FileRoller{
+    public:
+        // closed files go on to recompressor unless it is nullptr
+        FileRoller(uint64_t reserve, bool mapped, Recompressor* recompressor)
+          : reserve(reserve), mapped(mapped), recompressor(recompressor), thread(&FileRoller::run, this){}
+
+        ~FileRoller(){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            thread.join();
+            discard();
+        }
+
+        void prepare(const std::string& path){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                next_path = path;
+                preparing = true;
+            }
+            cv.notify_all();
+        }
+
+        LogFile take(){
+            // normally prepared long ago; waits only if rolls outpace the helper
+            std::unique_lock<std::mutex>lock(mutex);
+            cv.wait(lock, [this]{return !preparing;});
+            LogFile file = next;
+            next = LogFile();
+            if(file.fd < 0) return file;
+            if(::rename(temp_path().c_str(), next_path.c_str()) != 0){
+                close_log(file);
+                ::unlink(temp_path().c_str());
+                return LogFile();
+            }
+            file.path = next_path;
+            return file;
+        }
+
+        void discard(){
+            // a prepared file not rolled into yet; an abort must not leave its reserved blocks behind
+            std::lock_guard<std::mutex>lock(mutex);
+            if(preparing || next.fd < 0)    return;
+            close_log(next);
+            ::unlink(temp_path().c_str());
+            next = LogFile();
+        }
+
+        void retire(const LogFile& file){
+            if(file.fd < 0) return;
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                retiring.push_back(file);
+            }
+            cv.notify_all();
+        }
+
+        FileRoller(const FileRoller&) = delete;
+        FileRoller& operator=(const FileRoller&) = delete;
+
+    private:
+        const uint64_t reserve;
+        const bool mapped;
+        Recompressor* const recompressor;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool stopping = false;
+        bool preparing = false;
+        std::string next_path;
+        LogFile next;
+        std::vector<LogFile>retiring;
+        std::thread thread;
+
+        std::string temp_path() const{
+            // under its final name only once rolled into, a crash leaves no empty highest-numbered log
+            return next_path + ".next";
+        }
+
+        void run(){
+            std::unique_lock<std::mutex>lock(mutex);
+            for(;;){
+                cv.wait(lock, [this]{return stopping || preparing || !retiring.empty();});
+                if(preparing){
+                    // before retiring, a roll may be waiting on it
+                    const std::string path = temp_path();
+                    lock.unlock();
+                    const LogFile file = open_log(path, reserve, mapped);
+                    lock.lock();
+                    next = file;
+                    preparing = false;
+                    cv.notify_all();
+                }else if(!retiring.empty()){
+                    std::vector<LogFile>files;
+                    files.swap(retiring);
+                    lock.unlock();
+                    for(const LogFile& file : files){
+                        close_log(file);
+                        if(recompressor != nullptr) recompressor -> add(file.path);
+                    }
+                    lock.lock();
+                }else{
+                    return;
+                }
+            }
+        }
+    };
+
+    class BinaryEncoder{
+    public:
+        // file layout: header, then chunks of
+        //   'S' u32 id, u32 len, bytes       string table entry, precedes first use
+        //   'C' u32 id, u32 file, u32 func, u32 line, u8 level, u32 format, u8 n, n type ids
+        //                                    call site entry, file, func and format are string
+        //                                    ids, format is UINT32_MAX for streamed statements
+        //   'R' u32 len, bytes               record, call site and string_literal_t stored as u32 id,
+        //                                    SLOGF arguments untagged as in memory
+        static constexpr const char magic[8] = {'S', 'L', 'O', 'G', 'B', 'I', 'N', '\0'};
+        static constexpr const uint8_t version = 3;
+
+        typedef LogLine::DataTypes DataTypes;
+
+        static const char* type_name(size_t id){
+            static const char* const names[] = {"char", "char*", "int32", "int64", "uint32", "uint64", "double", "literal", "field"};
+            static_assert(sizeof(names) / sizeof(names[0]) == std::tuple_size<DataTypes>::value, "name every DataTypes entry");
+            return names[id];
+        }
+
+        static uint8_t type_size(size_t id){
+            static const auto sizes = make_sizes(std::make_index_sequence<std::tuple_size<DataTypes>::value>());
+            return sizes[id];
+        }   // payload bytes in the file, 0 for NUL-terminated strings
+
+        void begin(ByteBuffer& out){
+            strings.clear();
+            sites.clear();
+            out.append(magic, sizeof(magic));
+            put<uint8_t>(out, version);
+            put<uint16_t>(out, 0x0102);     // byte order mark
+            put<uint8_t>(out, sizeof(std::thread::id));
+            put<uint8_t>(out, std::tuple_size<DataTypes>::value);
+            for(size_t id = 0; id < std::tuple_size<DataTypes>::value; id++){
+                put<uint8_t>(out, type_size(id));
+                put<uint8_t>(out, static_cast<uint8_t>(strlen(type_name(id))));
+                out.append(type_name(id), strlen(type_name(id)));
+            }
+        }
+
+        LogSeverity write(ByteBuffer& out, LogLine& logline){
+            const char* data = logline.buffer() - logline.used_bytes;
+            const char* const end = data + logline.used_bytes;
+            record.clear();
+
+            const size_t fixed = sizeof(slogtime::timestamp_t) + sizeof(std::thread::id);
+            record.append(data, fixed);
+            data += fixed;
+            const CallSite* site = read<const CallSite*>(data);
+            append<uint32_t>(intern(out, site));
+            const LogSeverity level = site -> level();
+
+            if(site -> format() != nullptr){
+                record.append(data, end - data);    // fixed-size and NUL-terminated, nothing to intern
+            }else{
+                BinaryArgs args{*this, out};
+                visit_args(args, data, end);
+            }
+
+            out.push_back('R');
+            put<uint32_t>(out, static_cast<uint32_t>(record.size()));
+            out.append(record.data(), record.size());
+            return level;
+        }
+
+        template<typename T>
+        static T read(const char*& data){
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+            memcpy(&value, data, sizeof(T));
+            data += sizeof(T);
+            return *reinterpret_cast<T*>(&value);
+        }
+
+        static constexpr const uint8_t literal_id = TupleIndexHelper<LogLine::string_literal_t, DataTypes>::value;
+        static constexpr const uint8_t string_id = TupleIndexHelper<char*, DataTypes>::value;
+        static constexpr const uint8_t field_id = TupleIndexHelper<LogLine::field_t, DataTypes>::value;
+
+    private:
+        struct BinaryArgs{
+            BinaryEncoder& encoder;
+            ByteBuffer& out;
+
+            template<typename T>
+            void operator()(T arg){
+                encoder.record.push_back(static_cast<char>(TupleIndexHelper<T, DataTypes>::value));
+                encoder.append<T>(arg);
+            }
+
+            void operator()(StringArg arg){
+                encoder.record.push_back(static_cast<char>(string_id));
+                encoder.record.append(arg.s, arg.len + 1);
+            }
+
+            void operator()(FieldArg arg){
+                encoder.record.push_back(static_cast<char>(field_id));
+                encoder.record.append(arg.s, arg.len + 1);
+            }
+
+            void operator()(LogLine::string_literal_t arg){
+                encoder.record.push_back(static_cast<char>(literal_id));
+                encoder.append<uint32_t>(encoder.intern(out, arg.s));
+            }
+        };
+
+        std::unordered_map<const char*, uint32_t>strings;   // interned pointers of the current file
+        std::unordered_map<const CallSite*, uint32_t>sites;
+        std::string record;
+
+        template<size_t... I>
+        static std::array<uint8_t, sizeof...(I)> make_sizes(std::index_sequence<I...>){
+            return {{static_cast<uint8_t>(
+                std::is_same<typename std::tuple_element<I, DataTypes>::type, char*>::value
+                || std::is_same<typename std::tuple_element<I, DataTypes>::type, LogLine::field_t>::value ? 0
+                : std::is_same<typename std::tuple_element<I, DataTypes>::type, LogLine::string_literal_t>::value ? sizeof(uint32_t)
+                : sizeof(typename std::tuple_element<I, DataTypes>::type))...}};
+        }
+
+        template<typename T>
+        static void put(ByteBuffer& out, T value){
+            out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        template<typename T>
+        void append(T value){
+            record.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        uint32_t intern(ByteBuffer& out, const char* s){
+            if(s == nullptr)    s = "";
+            auto it = strings.find(s);
+            if(it != strings.end()) return it -> second;
+            const uint32_t id = static_cast<uint32_t>(strings.size());
+            strings.emplace(s, id);
+            const size_t len = strlen(s);
+            out.push_back('S');
+            put<uint32_t>(out, id);
+            put<uint32_t>(out, static_cast<uint32_t>(len));
+            out.append(s, len);
+            return id;
+        }
+
+        uint32_t intern(ByteBuffer& out, const CallSite* site){
+            auto it = sites.find(site);
+            if(it != sites.end())   return it -> second;
+            const uint32_t file = intern(out, site -> file());
+            const uint32_t func = intern(out, site -> func());
+            const uint32_t format = site -> format() != nullptr ? intern(out, site -> format()) : UINT32_MAX;
+            const uint32_t id = static_cast<uint32_t>(sites.size());
+            sites.emplace(site, id);
+            out.push_back('C');
+            put<uint32_t>(out, id);
+            put<uint32_t>(out, file);
+            put<uint32_t>(out, func);
+            put<uint32_t>(out, site -> line());
+            put<LogSeverity>(out, site -> level());
+            put<uint32_t>(out, format);
+            put<uint8_t>(out, site -> arg_count());
+            if(site -> arg_count() != 0)    out.append(reinterpret_cast<const char*>(site -> arg_types()), site -> arg_count());  // nullptr for streams
+            return id;
+        }
+    };
+
+    ConsoleSink::ConsoleSink(LogSeverity level, int fd)
+      : Sink(level), fd(fd){}
+
+    void ConsoleSink::write(const char* line, size_t bytes, LogSeverity level){
+        // the level tag is a TEXT line's second bracket, after the timestamp
+        const char* tag = bytes > 1 && line[0] == '[' ? static_cast<const char*>(memchr(line + 1, '[', bytes - 1)) : nullptr;
+        const char* close = tag != nullptr ? static_cast<const char*>(memchr(tag, ']', line + bytes - tag)) : nullptr;
+        if(close == nullptr){
+            pending.append(line, bytes);
+            return;
+        }
+        pending.append(line, tag + 1 - line);
+        pending.append(color_level(level));
+        pending.append(tag + 1, close - tag - 1);
+        pending.append(TERM_RESET);
+        pending.append(close, line + bytes - close);
+    }
+
+    void ConsoleSink::flush(){
+        // one write(2) per batch rather than per line
+        const char* data = pending.data();
+        size_t left = pending.size();
+        while(left != 0){
+            const ssize_t n = ::write(fd, data, left);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0)  break;
+            data += n;
+            left -= n;
+        }
+        pending.clear();
+    }
+
+    MemorySink::MemorySink(size_t capacity, LogSeverity level)
+      : Sink(level), capacity(std::max<size_t>(1, capacity)){}
+
+    void MemorySink::write(const char* line, size_t bytes, LogSeverity){
+        std::lock_guard<std::mutex>lock(mutex);
+        if(kept.size() == capacity) kept.pop_front();
+        kept.emplace_back(line, bytes != 0 && line[bytes - 1] == '\n' ? bytes - 1 : bytes);
+    }
+
+    std::vector<std::string>MemorySink::lines() const{
+        std::lock_guard<std::mutex>lock(mutex);
+        return std::vector<std::string>(kept.begin(), kept.end());
+    }
+
+    void MemorySink::clear(){
+        std::lock_guard<std::mutex>lock(mutex);
+        kept.clear();
+    }
+
+    // feeds one Sink from its own thread. The consumer only copies the line into
+    // a bounded buffer, and drops it when the sink has fallen that far behind;
+    // the thread swaps the buffer out and writes the whole batch
+    class SinkWorker{
+    public:
+        SinkWorker(std::shared_ptr<Sink> sink, size_t limit)
+          : sink(std::move(sink)), limit(limit), thread(&SinkWorker::run, this){}
+
+        ~SinkWorker(){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();      // what is queued still goes out
+        }
+
+        void push(const char* line, size_t bytes, LogSeverity level){
+            if(level < sink -> level()) return;
+            std::lock_guard<std::mutex>lock(mutex);
+            if(queued -> size() + entry_header + bytes > limit){
+                count(consumer_stats.sink_dropped);
+                return;
+            }
+            char* b = queued -> reserve(entry_header + bytes);
+            const uint32_t length = static_cast<uint32_t>(bytes);
+            memcpy(b, &length, sizeof(length));
+            b[sizeof(length)] = static_cast<char>(level);
+            memcpy(b + entry_header, line, bytes);
+            queued -> commit(entry_header + bytes);
+            if(waiting) cv.notify_one();    // a futex call per batch, not per line
+        }
+
+        void drain(){
+            // flush(): lines pushed so far have reached the sink
+            std::unique_lock<std::mutex>lock(mutex);
+            drained.wait(lock, [this]{return queued -> size() == 0 && !writing;});
+        }
+
+        SinkWorker(const SinkWorker&) = delete;
+        SinkWorker& operator=(const SinkWorker&) = delete;
+
+    private:
+        static constexpr const size_t entry_header = sizeof(uint32_t) + 1;    // length, level
+
+        const std::shared_ptr<Sink>sink;
+        const size_t limit;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable drained;
+        ByteBuffer buffers[2];
+        ByteBuffer* queued = &buffers[0];
+        bool waiting = false;
+        bool writing = false;
+        bool stopping = false;
+        std::thread thread;
+
+        void run(){
+            std::unique_lock<std::mutex>lock(mutex);
+            for(;;){
+                waiting = true;
+                cv.wait(lock, [this]{return stopping || queued -> size() != 0;});
+                waiting = false;
+                if(queued -> size() == 0)   return;
+                ByteBuffer* taken = queued;
+                queued = taken == &buffers[0] ? &buffers[1] : &buffers[0];
+                writing = true;
+                lock.unlock();
+
+                const char* data = taken -> data();
+                const char* const end = data + taken -> size();
+                while(data < end){
+                    uint32_t length;
+                    memcpy(&length, data, sizeof(length));
+                    const LogSeverity level = static_cast<LogSeverity>(data[sizeof(length)]);
+                    sink -> write(data + entry_header, length, level);
+                    data += entry_header + length;
+                }
+                sink -> flush();
+                taken -> clear();
+
+                lock.lock();
+                writing = false;
+                drained.notify_all();
+            }
+        }
+    };
+
+    // path.N.idx next to each TEXT, JSON or LOGFMT file, see log_index.h. One
+    // small write(2) per closed block; the open block is written when the file
+    // rolls or the writer goes away
+    class SidecarIndex{
+    public:
+        explicit SidecarIndex(const Config& config)
+          : enabled(config.index && config.format != OutputFormat::BINARY),
+          block_bytes(static_cast<uint64_t>(std::max(4u, config.index_block_kb)) * 1024),
+          format(config.format),
+          time_layout(config.time_layout){}
+
+        ~SidecarIndex(){
+            close();
+        }
+
+        void open(const std::string& path){
+            close();
+            if(!enabled)    return;
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd < 0)  return;
+            IndexHeader header{};
+            memcpy(header.magic, index_magic, sizeof(index_magic));
+            header.version = index_version;
+            header.format = static_cast<uint8_t>(format);
+            header.time_layout = static_cast<uint8_t>(time_layout);
+            put(&header, sizeof(header));
+        }
+
+        void add(uint64_t offset, size_t bytes, slogtime::timestamp_t ts, const CallSite* site){
+            if(fd < 0)  return;
+            if(block.lines == 0){
+                block.offset = offset;
+                block.min_ts = block.max_ts = ts;
+            }
+            block.bytes += bytes;
+            block.lines++;
+            block.min_ts = std::min<uint64_t>(block.min_ts, ts);
+            block.max_ts = std::max<uint64_t>(block.max_ts, ts);
+            block.levels |= 1u << static_cast<uint32_t>(site -> level());
+            index_bloom_add(block.sites, index_site_key(site -> file(), site -> line()));
+            if(block.bytes >= block_bytes)  close_block();
+        }
+
+        void close(){
+            if(fd < 0)  return;
+            if(block.lines != 0)    close_block();
+            ::close(fd);
+            fd = -1;
+        }
+
+        SidecarIndex(const SidecarIndex&) = delete;
+        SidecarIndex& operator=(const SidecarIndex&) = delete;
+
+    private:
+        const bool enabled;
+        const uint64_t block_bytes;
+        const OutputFormat format;
+        const TimeLayout time_layout;
+        int fd = -1;
+        IndexBlock block{};
+
+        void close_block(){
+            put(&block, sizeof(block));
+            block = IndexBlock{};
+        }
+
+        void put(const void* data, size_t size){
+            const char* p = static_cast<const char*>(data);
+            while(size != 0){
+                const ssize_t n = ::write(fd, p, size);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0)  return;
+                p += n;
+                size -= n;
+            }
+        }
+    };
+
+    class FileWriter{
+    public:
+        explicit FileWriter(const Config& config)
+          : roll_bytes(static_cast<uint64_t>(std::max(1u, config.roll_size)) * 1024 * 1024),
+          path(config.dir + config.name),
+          flush_interval(config.flush_interval_ms),
+          format(config.format),
+          formatter(make_formatter(config)),
+          roll_interval(config.roll_interval),
+          mapped(config.sink == FileSink::MMAP && config.compress_level == 0),
+          compressed(config.compress_level != 0),
+          file(std::max(4u, config.write_buffer_kb) * 1024, std::chrono::milliseconds(config.msync_interval_ms),
+            compressed ? new BlockCompressor(static_cast<int>(config.compress_level), block_bytes(config), config.format) : nullptr),
+          recompressor(config.recompress_level != 0
+            ? new Recompressor(static_cast<int>(config.recompress_level), block_bytes(config), config.format) : nullptr),
+          roller(compressed ? 0 : roll_bytes, mapped, recompressor.get()),
+          file_level(config.file_level),
+          lowest_level(config.file_level),
+          index(config){
+            for(const std::shared_ptr<Sink>& sink : config.sinks){
+                if(!sink)   continue;
+                sinks.emplace_back(new SinkWorker(sink, static_cast<size_t>(std::max(4u, config.sink_queue_kb)) * 1024));
+                lowest_level = std::min(lowest_level, sink -> level());
+            }
+        }
+
+        ~FileWriter(){
+            close();
+        }
+
+        void open(uint32_t first){
+            // path.first is the first file, later ones count up from it
+            file_index = first - 1;
+            roll(slogtime::now());
+        }
+
+        void close(){
+            roller.retire(file.swap(LogFile()));
+        }
+
+        uint32_t last_file() const noexcept{return file_index;}
+
+        void write(LogLine& logline){
+            const LogSeverity level = logline.level();
+            if(level < lowest_level)    return;
+            if(roll_interval != RollInterval::NONE && logline.timestamp() >= next_roll) roll(logline.timestamp());
+            ByteBuffer& out = file.buffer();
+            const size_t w_pos = out.size();
+            if(format == OutputFormat::BINARY){
+                if(!sinks.empty()){
+                    text.clear();
+                    formatter -> format(logline, text);
+                    fan_out(text.data(), text.size(), level);
+                }
+                if(level < file_level)  return;
+                binary.write(out, logline);
+            }else{
+                // formatted once, in place; the sinks copy it from the file buffer
+                formatter -> format(logline, out);
+                fan_out(out.data() + w_pos, out.size() - w_pos, level);
+                if(level < file_level){
+                    out.truncate(w_pos);
+                    return;
+                }
+            }
+            if(w_pos == 0)  pending_since = std::chrono::steady_clock::now();
+            written(out.size() - w_pos, logline.timestamp(), logline.site());
+        }
+
+        // a TEXT line already formatted by a worker
+        void write(const char* line, size_t bytes, slogtime::timestamp_t ts, const CallSite* site){
+            const LogSeverity level = site -> level();
+            fan_out(line, bytes, level);
+            if(level < file_level)  return;
+            if(roll_interval != RollInterval::NONE && ts >= next_roll)  roll(ts);
+            ByteBuffer& out = file.buffer();
+            if(out.size() == 0) pending_since = std::chrono::steady_clock::now();
+            out.append(line, bytes);
+            written(bytes, ts, site);
+        }
+
+        void flush(){
+            file.flush();
+        }
+
+        void truncate(){
+            // before a crash: nothing but the written bytes on disk, no prepared next file
+            file.truncate();
+            roller.discard();
+        }
+
+        void drain_sinks(){
+            for(std::unique_ptr<SinkWorker>& sink : sinks)  sink -> drain();
+        }
+
+        size_t pending() const noexcept{return file.pending();}
+        const LineFormatter& line_formatter() const noexcept{return *formatter;}
+
+        void idle(){
+            // trickling records would otherwise sit in the buffer until it fills
+            if(file.pending() == 0) return;
+            if(std::chrono::steady_clock::now() - pending_since >= flush_interval){
+                file.flush();
+                file.sync();
+            }
+        }
+
+    private:
+        const uint64_t roll_bytes;
+        const std::string path;
+        const std::chrono::milliseconds flush_interval;
+        const OutputFormat format;
+        const std::unique_ptr<const LineFormatter> formatter;
+        const RollInterval roll_interval;
+        const bool mapped;
+        const bool compressed;
+        FileBuffer file;
+        const std::unique_ptr<Recompressor>recompressor;   // outlives roller, which feeds it
+        FileRoller roller;
+        const LogSeverity file_level;
+        LogSeverity lowest_level;   // of the file and every sink, lower records are skipped unformatted
+        std::vector<std::unique_ptr<SinkWorker>>sinks;
+        ByteBuffer text{4096};      // BINARY files: the line the sinks get
+        BinaryEncoder binary;
+        SidecarIndex index;
+        uint64_t bytes_written = 0;
+        uint32_t file_index = 0;
+        slogtime::timestamp_t next_roll = 0;
+        std::chrono::steady_clock::time_point pending_since;
+
+        void fan_out(const char* line, size_t bytes, LogSeverity level){
+            for(std::unique_ptr<SinkWorker>& sink : sinks)  sink -> push(line, bytes, level);
+        }
+
+        void written(size_t bytes, slogtime::timestamp_t ts, const CallSite* site){
+            index.add(bytes_written, bytes, ts, site);
+            bytes_written += bytes;
+            count(consumer_stats.written);
+            count(consumer_stats.bytes, bytes);
+            if(site -> level() >= LogSeverity::FATAL) file.flush();
+            else    file.commit();
+            if(bytes_written > roll_bytes)  roll(ts);
+        }
+
+        std::string file_name(uint32_t index) const{
+            static const char* const extensions[] = {".txt", ".slog", ".jsonl", ".logfmt"};
+            return path + "." + std::to_string(index) + extensions[static_cast<size_t>(format)] + (compressed ? ".lz" : "");
+        }
+
+        static size_t block_bytes(const Config& config){
+            return static_cast<size_t>(std::min(std::max(4u, config.compress_block_kb), 1u << 20)) * 1024;
+        }
+
+        void roll(slogtime::timestamp_t ts){
+            const auto begin = std::chrono::steady_clock::now();
+            LogFile next = roller.take();
+            ++file_index;
+            if(next.fd < 0) next = open_log(file_name(file_index), compressed ? 0 : roll_bytes, mapped);   // first file, or the helper failed
+            roller.retire(file.swap(next));
+            index.open(path + "." + std::to_string(file_index) + ".idx");
+            roller.prepare(file_name(file_index + 1));
+            bytes_written = 0;
+            if(format == OutputFormat::BINARY)  binary.begin(file.buffer());
+            if(roll_interval != RollInterval::NONE) next_roll = next_boundary(ts);
+            count(consumer_stats.rolls);
+            count(consumer_stats.roll_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
+        }
+
+        slogtime::timestamp_t next_boundary(slogtime::timestamp_t ts) const{
+            // local wall-clock hour or midnight after ts, mktime copes with DST changes
+            time_t t = static_cast<time_t>(ts / 1000000000);
+            std::tm tm;
+            localtime_r(&t, &tm);
+            tm.tm_sec = 0;
+            tm.tm_min = 0;
+            if(roll_interval == RollInterval::DAILY){
+                tm.tm_hour = 0;
+                tm.tm_mday++;
+            }else{
+                tm.tm_hour++;
+            }
+            tm.tm_isdst = -1;
+            return static_cast<slogtime::timestamp_t>(mktime(&tm)) * 1000000000;
+        }
+    };
+
+    // TEXT formatting spread over worker threads: the consumer fills batches in
+    // queue order, and writes them out in the same order once they are formatted
+    class FormatPool{
+    public:
+        FormatPool(uint32_t workers, const LineFormatter& formatter, Parker& consumer_parker)
+          : formatter(formatter), consumer_parker(consumer_parker){
+            for(uint32_t i = 0; i < workers * 2 + 1; i++)   batches.emplace_back(new Batch);
+            for(uint32_t i = 0; i < workers; i++)   threads.emplace_back(&FormatPool::work, this);
+        }
+
+        ~FormatPool(){
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            for(std::thread& thread : threads)  thread.join();
+        }
+
+        LogLine* slot(){
+            // the next record of the batch being filled, nullptr while every batch is in flight
+            Batch& batch = *batches[fill_index % batches.size()];
+            if(batch.state.load(std::memory_order_acquire) != FREE) return nullptr;
+            if(batch.lines.size() == batch.count)   batch.lines.emplace_back(nullptr);
+            return &batch.lines[batch.count];
+        }
+
+        void fill(){
+            if(++batches[fill_index % batches.size()] -> count == batch_size)   dispatch();
+        }   // the slot holds a record now
+
+        void dispatch(){
+            Batch& batch = *batches[fill_index % batches.size()];
+            if(batch.count == 0 || batch.state.load(std::memory_order_relaxed) != FREE) return;
+            batch.state.store(QUEUED, std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex>lock(mutex);
+                jobs.push_back(&batch);
+            }
+            cv.notify_one();
+            fill_index++;
+            in_flight++;
+        }
+
+        bool ready() const{
+            return in_flight != 0 && batches[commit_index % batches.size()] -> state.load(std::memory_order_acquire) == DONE;
+        }   // the oldest batch in flight is formatted
+
+        bool busy() const{return in_flight != 0;}
+
+        void write(FileWriter& writer){
+            while(ready()){
+                Batch& batch = *batches[commit_index % batches.size()];
+                size_t begin = 0;
+                for(size_t i = 0; i < batch.count; i++){
+                    const Formatted& line = batch.formatted[i];
+                    writer.write(batch.out.data() + begin, line.end - begin, line.ts, line.site);
+                    begin = line.end;
+                }
+                batch.count = 0;
+                batch.state.store(FREE, std::memory_order_relaxed);
+                commit_index++;
+                in_flight--;
+            }
+        }
+
+        FormatPool(const FormatPool&) = delete;
+        FormatPool& operator=(const FormatPool&) = delete;
+
+    private:
+        static constexpr const size_t batch_size = 256;
+        enum : int{FREE, QUEUED, DONE};
+
+        struct Formatted{
+            size_t end;
+            slogtime::timestamp_t ts;
+            const CallSite* site;
+        };
+
+        struct Batch{
+            std::deque<LogLine>lines;   // slots keep their heap buffers across batches
+            size_t count = 0;
+            ByteBuffer out{64 * 1024};
+            std::vector<Formatted>formatted;
+            std::atomic<int>state{FREE};
+        };
+
+        const LineFormatter& formatter;
+        Parker& consumer_parker;
+        std::vector<std::unique_ptr<Batch>>batches;     // a ring in sequence order
+        uint64_t fill_index = 0;
+        uint64_t commit_index = 0;
+        size_t in_flight = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<Batch*>jobs;
+        bool stopping = false;
+        std::vector<std::thread>threads;
+
+        void work(){
+            for(;;){
+                Batch* batch;
+                {
+                    std::unique_lock<std::mutex>lock(mutex);
+                    cv.wait(lock, [this]{return stopping || !jobs.empty();});
+                    if(jobs.empty())    return;
+                    batch = jobs.front();
+                    jobs.pop_front();
+                }
+                batch -> out.clear();
+                batch -> formatted.clear();
+                for(size_t i = 0; i < batch -> count; i++){
+                    LogLine& line = batch -> lines[i];
+                    formatter.format(line, batch -> out);
+                    batch -> formatted.push_back(Formatted{batch -> out.size(), line.timestamp(), line.site()});
+                }
+                batch -> state.store(DONE, std::memory_order_release);
+                consumer_parker.unpark();
+            }
+        }
+    };
+
+    class Logger{
+    public:
+        explicit Logger(const Config& config)
+          : config(config),
+          state(State::INIT),
+          buffer_queue(create_queue(config)),
+          file_writer(config),
+          holds(buffer_queue -> keeps()),
+          next_stats(std::chrono::steady_clock::now() + std::chrono::milliseconds(config.stats_interval_ms)),
+          pool(config.format_workers != 0 && config.format != OutputFormat::BINARY ? new FormatPool(config.format_workers, file_writer.line_formatter(), consumer_parker) : nullptr){}
+        
+        ~Logger(){
+            stop();
+        }
+
+        void start(uint32_t first_file){
+            // records queue up from construction on, files are opened only here
+            file_writer.open(first_file);
+            if(holds)   recover(config.ring_file + ".crashed");
+            state.store(State::ENABLED, std::memory_order_release);
+            thread = std::thread(&Logger::pop, this);
+        }
+
+        void stop(){
+            // drains what was queued and hands the files over to be closed; the memory stays
+            // valid for a statement that still holds this logger, whose record is then lost
+            if(!thread.joinable())  return;
+            state.store(State::DISABLED);
+            consumer_parker.unpark();
+            thread.join();
+            file_writer.close();
+            count(consumer_stats.retired_dropped, dropped());
+            count(consumer_stats.overwritten, overwritten());
+        }
+
+        // init() with the same dir and name continues after the files of the logger it replaces
+        uint32_t next_file(const Logger& old) const{
+            return config.dir == old.config.dir && config.name == old.config.name ? old.file_writer.last_file() + 1 : 1;
+        }
+
+        WaitStrategy producer_wait() const{return config.producer_wait;}
+
+        uint64_t dropped() const{
+            return buffer_queue -> dropped() - marker_retries.load(std::memory_order_relaxed);
+        }
+
+        uint64_t overwritten() const{
+            // only pooled buffers discard records the queue had already accepted
+            const bool overwrites = config.queue_mode == QueueMode::SHARED
+                && config.overflow == OverflowPolicy::OVERWRITE_OLDEST && config.max_buffers >= 3;
+            return overwrites ? dropped() : 0;
+        }
+
+        void add(LogLine&& logline){
+            if(buffer_queue -> push(std::move(logline)))    count(stat_shard().enqueued);
+            consumer_parker.unpark();
+        }
+
+        char* reserve(size_t bytes){
+            char* record = buffer_queue -> reserve(bytes);
+            if(record != nullptr)   count(stat_shard().enqueued);
+            return record;
+        }
+
+        void commit(char* record){
+            buffer_queue -> commit(record);
+            consumer_parker.unpark();
+        }
+
+        bool flush(std::chrono::steady_clock::time_point deadline, WaitStrategy wait){
+            // a control record carries the address of a marker the consumer sets once it is written out;
+            // the caller may give up first, so whichever side is last frees it
+            FlushMarker* marker = new FlushMarker;
+            for(Waiter full(wait, config);;){
+                // a full queue under a dropping OverflowPolicy must not lose the marker
+                LogLine line(&flush_site);
+                line << static_cast<uint64_t>(reinterpret_cast<uintptr_t>(marker));
+                if(buffer_queue -> push(std::move(line)))    break;
+                marker_retries.fetch_add(1, std::memory_order_relaxed);
+                if(std::chrono::steady_clock::now() >= deadline){
+                    delete marker;
+                    return false;
+                }
+                full.wait([]{return false;});
+            }
+            consumer_parker.unpark();
+            Waiter waiter(wait, config, &flush_parker);
+            auto ready = [marker]{return marker -> done.load(std::memory_order_acquire);};
+            while(!ready() && std::chrono::steady_clock::now() < deadline)  waiter.wait(ready);
+            const bool done = ready();
+            marker -> release();
+            return done;
+        }
+
+        bool fatal_flush(int sig){
+            // async-signal-safe: no allocation, lock or wakeup, only a request the consumer finds within
+            // a backoff or park timeout, and a yield loop until it is done or the deadline passes.
+            // sig 0 is slog::abort, which logs nothing of its own
+            if(state.load(std::memory_order_acquire) != State::ENABLED || std::this_thread::get_id() == consumer_id.load())  return false;
+            fatal_signal.store(sig, std::memory_order_release);
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(config.fatal_flush_timeout_ms);
+            while(!fatal_done.load(std::memory_order_acquire)){
+                if(std::chrono::steady_clock::now() >= deadline)    return false;
+                std::this_thread::yield();
+            }
+            return true;
+        }
+
+        void pop(){
+            consumer_id.store(std::this_thread::get_id());
+            LogLine logline(&flush_site);
+            Waiter waiter(config.consumer_wait, config, &consumer_parker);
+            auto ready = [this]{
+                return !buffer_queue -> empty() || (pool && pool -> ready()) || state.load(std::memory_order_acquire) != State::ENABLED
+                    || fatal_requested();
+            };
+            while(state.load(std::memory_order_seq_cst) == State::ENABLED){
+                const bool popped = pool ? pump() : step(logline);
+                if(fatal_requested() && fatal_due(popped)){
+                    if(pool){
+                        pool -> dispatch();
+                        drain();
+                    }
+                    fatal_drain();
+                    continue;
+                }
+                if(popped){
+                    waiter.reset();
+                    continue;
+                }
+                if(!pool || !pool -> busy()){
+                    tick();
+                    file_writer.idle();
+                    settle();
+                }
+                waiter.wait(ready);
+            }
+            // read remaining log
+            if(pool){
+                for(;;){
+                    if(pump())  continue;
+                    pool -> dispatch();
+                    if(!pool -> busy()) break;
+                    drain();
+                }
+            }else{
+                while(step(logline));
+            }
+            file_writer.flush();
+            buffer_queue -> release();
+        }
+          
+    private:
+        enum class State{
+            INIT,
+            ENABLED,
+            DISABLED,
+        };
+        // heap allocated so a flush() that timed out can walk away from it
+        struct FlushMarker{
+            std::atomic<bool>done{false};
+            std::atomic<int>refs{2};    // the flush() caller and the consumer
+
+            void release(){
+                if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)   delete this;
+            }
+        };
+
+        const Config config;
+        std::atomic<State>state;
+        Parker consumer_parker;     // consumer parked on an empty queue
+        Parker flush_parker;        // threads waiting in flush()
+        std::atomic<uint64_t>marker_retries{0};    // flush markers the queue counted as dropped
+        std::unique_ptr<BufferBase>buffer_queue;
+        FileWriter file_writer;
+        const bool holds;   // the queue keeps popped records until release()
+        uint64_t pops = 0;
+        std::chrono::steady_clock::time_point next_stats;
+        std::unique_ptr<FormatPool>pool;    // format_workers only
+        std::atomic<std::thread::id>consumer_id{};
+        static_assert(std::atomic<std::thread::id>::is_always_lock_free);
+        std::atomic<int>fatal_signal{-1};   // a fatal_flush() request, -1 while there is none
+        std::atomic<bool>fatal_done{false};
+        uint64_t fatal_left = ~uint64_t(0);     // consumer, records to write before fatal_drain(), all ones until counted
+        std::thread thread;
+
+        static const CallSite flush_site;   // marks control records, never written out
+        static const CallSite recovered_site;
+        static const CallSite stats_site;
+        static const CallSite fatal_site;
+
+        bool fatal_requested() const{
+            return fatal_signal.load(std::memory_order_acquire) >= 0 && !fatal_done.load(std::memory_order_relaxed);
+        }
+
+        bool fatal_due(bool popped){
+            // the records queued when the request came in are out, or the queue ran dry;
+            // producers that keep logging would otherwise hold it off past the deadline
+            if(fatal_left == ~uint64_t(0))  fatal_left = buffer_queue -> depth();
+            if(popped && fatal_left != 0)   --fatal_left;
+            return !popped || fatal_left == 0;
+        }
+
+        void fatal_drain(){
+            // consumer, on an empty queue: what the process logged before the request is out,
+            // then the signal's record, and the file cut to its length before the process dies
+            const int sig = fatal_signal.load(std::memory_order_acquire);
+            if(sig != 0){
+                LogLine line(&fatal_site);
+                line << "caught fatal signal " << sig;
+                file_writer.write(line);
+            }
+            file_writer.flush();
+            file_writer.truncate();
+            file_writer.drain_sinks();
+            if(holds)   buffer_queue -> release();
+            fatal_done.store(true, std::memory_order_release);
+        }
+
+        bool step(LogLine& logline){
+            if(!buffer_queue -> pop(logline))   return false;
+            write(logline);
+            if(holds && file_writer.pending() == 0) buffer_queue -> release();
+            if((++pops & 63) == 0)  tick();
+            return true;
+        }
+
+        bool pump(){
+            // step with format workers: false once the queue is empty or every batch is in flight
+            if(pool -> ready()){
+                pool -> write(file_writer);
+                return true;
+            }
+            LogLine* slot = pool -> slot();
+            if(slot == nullptr) return false;
+            if(!buffer_queue -> pop(*slot)){
+                pool -> dispatch();     // a partial batch rather than wait for it to fill
+                return false;
+            }
+            if(slot -> site() == &flush_site){
+                // everything popped before the marker must be out when its flush() returns
+                pool -> dispatch();
+                drain();
+                write(*slot);
+                return true;
+            }
+            count(consumer_stats.popped);
+            pool -> fill();
+            if((++pops & 63) == 0)  tick();
+            return true;
+        }
+
+        void drain(){
+            Waiter waiter(config.consumer_wait, config, &consumer_parker);
+            auto ready = [this]{return pool -> ready();};
+            while(pool -> busy()){
+                if(pool -> ready()) pool -> write(file_writer);
+                else    waiter.wait(ready);
+            }
+        }
+
+        void tick(){
+            // consumer: samples this logger's queue depth, and logs the counters every stats_interval_ms
+            const uint64_t depth = buffer_queue -> depth();
+            if(depth > consumer_stats.depth_max.load(std::memory_order_relaxed)){
+                consumer_stats.depth_max.store(depth, std::memory_order_relaxed);
+            }
+            if(config.stats_interval_ms == 0)   return;
+            const auto now = std::chrono::steady_clock::now();
+            if(now < next_stats)    return;
+            next_stats = now + std::chrono::milliseconds(config.stats_interval_ms);
+            const Stats current = slog::stats();
+            LogLine line(&stats_site);
+            line << "slog stats: enqueued=" << current.enqueued << " dropped=" << current.dropped
+                << " written=" << current.written << " bytes=" << current.bytes_written
+                << " depth=" << current.queue_depth << " depth_max=" << current.queue_depth_max
+                << " stalls=" << current.producer_stalls << " stall_ns=" << current.producer_stall_ns
+                << " rolls=" << current.rolls << " roll_ns=" << current.roll_ns
+                << " heap_allocations=" << current.heap_allocations << " sink_dropped=" << current.sink_dropped;
+            file_writer.write(line);
+        }
+
+        void settle(){
+            // on an empty queue a file-backed ring hands its space back once the bytes are out
+            if(!holds)  return;
+            file_writer.flush();
+            buffer_queue -> release();
+        }
+
+        void recover(const std::string& path){
+            // what a crashed process committed to the ring but never wrote, ahead of this run's records
+            const uint64_t recovered = ByteRingBuffer::recover(path, [this](LogLine& logline){file_writer.write(logline);});
+            if(recovered != 0){
+                LogLine note(&recovered_site);
+                note << "recovered " << recovered << " records from " << path;
+                file_writer.write(note);
+            }
+            file_writer.flush();
+            ::unlink(path.c_str());
+        }
+
+        void write(LogLine& logline){
+            if(logline.site() != &flush_site){
+                count(consumer_stats.popped);
+                file_writer.write(logline);
+                return;
+            }
+            // control record: the only argument is the address of a flush() caller's flag
+            const char* arg = logline.buffer() - logline.used_bytes
+                + sizeof(slogtime::timestamp_t) + sizeof(std::thread::id) + sizeof(const CallSite*) + sizeof(uint8_t);
+            FlushMarker* marker = reinterpret_cast<FlushMarker*>(BinaryEncoder::read<uint64_t>(arg));
+            file_writer.flush();
+            file_writer.drain_sinks();
+            if(holds)   buffer_queue -> release();
+            marker -> done.store(true, std::memory_order_release);
+            marker -> release();
+            flush_parker.unpark();
+        }
+    };
+
+    const CallSite Logger::flush_site(__FILE__, "flush", __LINE__, LogSeverity::FATAL, false);
+    const CallSite Logger::recovered_site(__FILE__, "recover", __LINE__, LogSeverity::WARN, false);
+    const CallSite Logger::stats_site(__FILE__, "stats", __LINE__, LogSeverity::INFO, false);
+    const CallSite Logger::fatal_site(__FILE__, "on_fatal_signal", __LINE__, LogSeverity::FATAL, false);
+
+    std::atomic<LogSeverity>log_level{LogSeverity::DEBUG};
+
+    namespace{
+        // epoch-based reclamation of replaced loggers: a thread inside a Slog
+        // publishes the epoch it entered in, and retire() waits until no thread
+        // is still inside an epoch from before the swap
+        struct alignas(64) EpochSlot{
+            std::atomic<uint64_t>epoch{0};  // 0 while outside
+            std::atomic<bool>used{true};
+            EpochSlot* next = nullptr;      // never unlinked, reused after its thread exits
+        };
+
+        std::atomic<EpochSlot*>epoch_slots{nullptr};
+        std::atomic<uint64_t>global_epoch{1};
+        std::atomic<unsigned int>fatal_drains{0};   // drain_channels() calls in flight, retire() waits them out too
+
+        struct ThreadEpoch{
+            EpochSlot* const slot = claim();
+            unsigned int depth = 0;     // a streamed argument may log too
+            std::vector<Logger*>retired;    // replaced from inside this thread's statement, freed as it ends
+
+            ~ThreadEpoch(){
+                slot -> epoch.store(0, std::memory_order_release);
+                slot -> used.store(false, std::memory_order_release);
+                free_retired();
+            }
+
+            void free_retired(){
+                std::vector<Logger*>loggers;
+                loggers.swap(retired);
+                for(Logger* old : loggers)  delete old;
+            }
+
+            static EpochSlot* claim(){
+                for(EpochSlot* slot = epoch_slots.load(std::memory_order_acquire); slot != nullptr; slot = slot -> next){
+                    if(!slot -> used.load(std::memory_order_relaxed) && !slot -> used.exchange(true, std::memory_order_acquire))  return slot;
+                }
+                EpochSlot* slot = new EpochSlot;
+                slot -> next = epoch_slots.load(std::memory_order_relaxed);
+                while(!epoch_slots.compare_exchange_weak(slot -> next, slot, std::memory_order_release, std::memory_order_relaxed));
+                return slot;
+            }
+        };
+
+        thread_local ThreadEpoch thread_epoch;
+
+        void enter_epoch(){
+            ThreadEpoch& local = thread_epoch;
+            // seq_cst pairs with retire(): either it sees this slot or we see the new logger
+            if(local.depth++ == 0)  local.slot -> epoch.store(global_epoch.load(std::memory_order_acquire), std::memory_order_seq_cst);
+        }
+
+        void exit_epoch(){
+            ThreadEpoch& local = thread_epoch;
+            if(--local.depth != 0)  return;
+            local.slot -> epoch.store(0, std::memory_order_release);
+            if(!local.retired.empty())  local.free_retired();
+        }
+
+        struct EpochGuard{
+            EpochGuard(){enter_epoch();}
+            ~EpochGuard(){exit_epoch();}
+        };
+
+        void retire(Logger* old, ThreadEpoch* own, Logger* next = nullptr){
+            // called after the channel's pointer was swapped: drains and closes old once no other
+            // thread can still be using it, then starts next. The caller's own statement, if any,
+            // cannot be waited for, it still holds old, so the delete waits until that statement ends
+            const uint64_t epoch = global_epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+            for(EpochSlot* slot = epoch_slots.load(std::memory_order_acquire); slot != nullptr; slot = slot -> next){
+                if(own != nullptr && slot == own -> slot)   continue;
+                for(;;){
+                    const uint64_t entered = slot -> epoch.load(std::memory_order_seq_cst);
+                    if(entered == 0 || entered >= epoch)    break;
+                    std::this_thread::yield();
+                }
+            }
+            while(fatal_drains.load(std::memory_order_seq_cst) != 0)    std::this_thread::yield();
+            old -> stop();
+            if(next != nullptr) next -> start(next -> next_file(*old));
+            if(own != nullptr)  own -> retired.push_back(old);
+            else    delete old;
+        }
+
+        std::atomic<Channel*>channel_list{nullptr};
+        std::mutex channel_mutex;   // lookup and creation; channel_list is walked without it
+
+        Channel& default_channel(){
+            static Channel& channel = slog::channel("");
+            return channel;
+        }
+    }
+
+    Channel::Channel(const std::string& name, std::atomic<LogSeverity>* threshold)
+        : name_(name), threshold(threshold != nullptr ? threshold : &own_threshold){}
+
+    void Channel::init(const Config& config){
+        // producers switch to the new logger's queue at once, but it opens its files only after the
+        // old one is drained and closed, and with the same dir and name it goes on from the old file index
+        Logger* next = new Logger(config);
+        Logger* old = logger.exchange(next, std::memory_order_seq_cst);
+        if(old != nullptr)  retire(old, thread_epoch.depth != 0 ? &thread_epoch : nullptr, next);
+        else    next -> start(1);
+    }
+
+    void Channel::flush(){
+        EpochGuard guard;
+        Logger* current = logger.load(std::memory_order_seq_cst);
+        if(current != nullptr)  current -> flush(std::chrono::steady_clock::time_point::max(), current -> producer_wait());
+    }
+
+    bool Channel::flush(std::chrono::milliseconds timeout){
+        EpochGuard guard;
+        Logger* current = logger.load(std::memory_order_seq_cst);
+        return current == nullptr || current -> flush(std::chrono::steady_clock::now() + timeout, current -> producer_wait());
+    }
+
+    uint64_t Channel::dropped() const{
+        EpochGuard guard;
+        Logger* current = logger.load(std::memory_order_seq_cst);
+        return current == nullptr ? 0 : current -> dropped();
+    }
+
+    Channel& channel(const std::string& name){
+        // channels live as long as the process, consumers of other channels may
+        // still walk the list at exit; their loggers are drained and closed then
+        struct Shutdown{
+            ~Shutdown(){
+                for(Channel* channel = channel_list.load(std::memory_order_acquire); channel != nullptr; channel = channel -> next){
+                    Logger* old = channel -> logger.exchange(nullptr, std::memory_order_seq_cst);
+                    if(old != nullptr)  retire(old, nullptr);   // this thread's thread_locals are gone by now
+                }
+            }
+        };
+        static std::unordered_map<std::string, Channel*>channels;
+        static Shutdown shutdown;
+        std::lock_guard<std::mutex>lock(channel_mutex);
+        Channel*& slot = channels[name];
+        if(slot == nullptr){
+            slot = new Channel(name, name.empty() ? &log_level : nullptr);
+            slot -> next = channel_list.load(std::memory_order_relaxed);
+            channel_list.store(slot, std::memory_order_release);
+        }
+        return *slot;
+    }
+
+    Slog::Slog() : Slog(default_channel()){}
+
+    Slog::Slog(Channel& channel)
+        : logger((enter_epoch(), channel.logger.load(std::memory_order_seq_cst))){}
+
+    Slog::~Slog(){
+        exit_epoch();
+    }
+
+    bool Slog::operator+=(LogLine& logline){
+        if(logger == nullptr)   return false;
+        logger -> add(std::move(logline));
+        return true;
+    }
+
+    char* Slog::reserve(size_t bytes){
+        return logger == nullptr ? nullptr : logger -> reserve(bytes);
+    }
+
+    void Slog::commit(char* record){
+        logger -> commit(record);
+    }
+
+    void init(const std::string& dir, const std::string filename, uint32_t roll_size){
+        Config config;
+        config.dir = dir;
+        config.name = filename;
+        config.roll_size = roll_size;
+        init(config);
+    }
+
+    void drain_channels(int sig){
+        // fatal paths: bounded, and without the lookup mutex a crashed thread may hold; fatal_drains
+        // rather than an EpochGuard, whose first use on a thread allocates its slot
+        fatal_drains.fetch_add(1, std::memory_order_seq_cst);
+        for(Channel* channel = channel_list.load(std::memory_order_acquire); channel != nullptr; channel = channel -> next){
+            Logger* current = channel -> logger.load(std::memory_order_seq_cst);
+            if(current != nullptr)  current -> fatal_flush(sig);
+        }
+        fatal_drains.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    namespace{
+        std::atomic<bool>aborting{false};
+        constexpr const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+        struct sigaction previous_actions[sizeof(fatal_signals) / sizeof(fatal_signals[0])];    // chained to after the drain
+
+        // the consumers write what is queued and the signal's record; this thread only
+        // raises a flag and yields, whatever it interrupted (malloc, a queue or parker lock)
+        void on_fatal_signal(int sig){
+            if(!aborting.exchange(true))    drain_channels(sig);
+            // the handler that was there before, a crash reporter or sanitizer, or the default action
+            for(size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++){
+                if(fatal_signals[i] == sig) ::sigaction(sig, &previous_actions[i], nullptr);
+            }
+            ::raise(sig);
+        }
+
+        void install_fatal_handlers(){
+            static std::once_flag once;
+            std::call_once(once, []{
+                for(size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++){
+                    struct sigaction action{};
+                    action.sa_handler = on_fatal_signal;
+                    sigemptyset(&action.sa_mask);
+                    action.sa_flags = SA_RESETHAND;
+                    ::sigaction(fatal_signals[i], &action, &previous_actions[i]);
+                }
+            });
+        }
+    }
+
+    void init(const Config& config){
+        default_channel().init(config);
+        if(config.handle_fatal_signals) install_fatal_handlers();
+    }
+
+    void flush(){
+        default_channel().flush();
+    }
+
+    bool flush(std::chrono::milliseconds timeout){
+        return default_channel().flush(timeout);
+    }
+
+    void abort(){
+        aborting.store(true);   // the SIGABRT handler has nothing left to do
+        drain_channels(0);
+        std::abort();
+    }
+
+    void set_log_level(LogSeverity level){
+        log_level.store(level, std::memory_order_relaxed);
+    }
+
+    LogSeverity get_log_level(){
+        return log_level.load(std::memory_order_relaxed);
+    }
+
+    uint64_t get_dropped_count(){
+        return default_channel().dropped();
+    }
+
+    Stats stats(){
+        EpochGuard guard;
+        uint64_t dropped = 0;
+        uint64_t overwritten = 0;
+        for(Channel* channel = channel_list.load(std::memory_order_acquire); channel != nullptr; channel = channel -> next){
+            Logger* current = channel -> logger.load(std::memory_order_seq_cst);
+            if(current == nullptr)  continue;
+            dropped += current -> dropped();
+            overwritten += current -> overwritten();
+        }
+        return collect_stats(dropped, overwritten);
+    }
+}
+
+namespace slog{
+    bool decode_binary(std::istream& in, std::ostream& out){
+        typedef BinaryEncoder::DataTypes DataTypes;
+        const std::string file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        const char* data = file.data();
+        const char* const end = data + file.size();
+        auto has = [&](size_t n){return static_cast<size_t>(end - data) >= n;};
+
+        const size_t header = sizeof(BinaryEncoder::magic) + 5;
+        if(!has(header) || memcmp(data, BinaryEncoder::magic, sizeof(BinaryEncoder::magic)) != 0)  return false;
+        data += sizeof(BinaryEncoder::magic);
+        if(BinaryEncoder::read<uint8_t>(data) != BinaryEncoder::version)   return false;
+        if(BinaryEncoder::read<uint16_t>(data) != 0x0102)  return false;
+        if(BinaryEncoder::read<uint8_t>(data) != sizeof(std::thread::id))  return false;
+
+        // map the writer's type ids onto ours by name
+        const uint8_t type_cnt = BinaryEncoder::read<uint8_t>(data);
+        std::vector<int> type_map(type_cnt, -1);
+        std::vector<uint8_t> type_sizes(type_cnt, 0);
+        for(uint8_t i = 0; i < type_cnt; i++){
+            if(!has(2)) return false;
+            type_sizes[i] = BinaryEncoder::read<uint8_t>(data);
+            const uint8_t name_len = BinaryEncoder::read<uint8_t>(data);
+            if(!has(name_len))  return false;
+            const std::string name(data, name_len);
+            data += name_len;
+            for(size_t id = 0; id < std::tuple_size<DataTypes>::value; id++){
+                if(name == BinaryEncoder::type_name(id) && type_sizes[i] == BinaryEncoder::type_size(id)) type_map[i] = static_cast<int>(id);
+            }
+        }
+
+        std::deque<std::string> strings;   // deque keeps c_str() stable as it grows
+        auto literal = [&](const char*& p){
+            const uint32_t id = BinaryEncoder::read<uint32_t>(p);
+            return LogLine::string_literal_t(id < strings.size() ? strings[id].c_str() : "?");
+        };
+
+        std::deque<CallSite> sites;
+        std::deque<std::vector<uint8_t>> site_types;
+        const CallSite unknown("?", "?", 0, LogSeverity::INFO, false);
+
+        LogLine line(&unknown);
+        ByteBuffer text(1 << 16);
+        auto finish = [&](bool complete){
+            out.write(text.data(), text.size());
+            return complete;
+        };
+        while(data < end){
+            if(text.size() >= (1 << 15)){
+                out.write(text.data(), text.size());
+                text.clear();
+            }
+            const char kind = *data++;
+            if(kind == 'S'){
+                if(!has(8)) return finish(false);
+                const uint32_t id = BinaryEncoder::read<uint32_t>(data);
+                const uint32_t len = BinaryEncoder::read<uint32_t>(data);
+                if(!has(len) || id != strings.size()) return finish(false);
+                strings.emplace_back(data, len);
+                data += len;
+                continue;
+            }
+            if(kind == 'C'){
+                if(!has(5 * sizeof(uint32_t) + sizeof(LogSeverity) + 1))   return finish(false);
+                const uint32_t id = BinaryEncoder::read<uint32_t>(data);
+                const char* file = literal(data).s;
+                const char* func = literal(data).s;
+                const uint32_t line_no = BinaryEncoder::read<uint32_t>(data);
+                const LogSeverity level = BinaryEncoder::read<LogSeverity>(data);
+                const uint32_t format = BinaryEncoder::read<uint32_t>(data);
+                const uint8_t arg_count = BinaryEncoder::read<uint8_t>(data);
+                if(id != sites.size() || level > LogSeverity::FATAL || !has(arg_count))  return finish(false);
+                if(format != UINT32_MAX && format >= strings.size())   return finish(false);
+                std::vector<uint8_t>& types = site_types.emplace_back(arg_count);
+                for(uint8_t i = 0; i < arg_count; i++){
+                    const uint8_t file_id = static_cast<uint8_t>(*data++);
+                    // only fixed-size and string arguments are written untagged
+                    if(file_id >= type_cnt || type_map[file_id] < 0 || type_map[file_id] == BinaryEncoder::literal_id
+                        || type_map[file_id] == BinaryEncoder::field_id)   return finish(false);
+                    types[i] = static_cast<uint8_t>(type_map[file_id]);
+                }
+                if(format == UINT32_MAX)    sites.emplace_back(file, func, line_no, level, false);
+                else    sites.emplace_back(file, func, line_no, level, strings[format].c_str(), types.data(), arg_count, false);
+                continue;
+            }
+            if(kind != 'R' || !has(4))  return finish(false);
+            const uint32_t len = BinaryEncoder::read<uint32_t>(data);
+            if(!has(len))   return finish(false);     // torn write at the end of the file
+            const char* rec = data;
+            const char* const rec_end = data + len;
+            data = rec_end;
+
+            const size_t fixed = sizeof(slogtime::timestamp_t) + sizeof(std::thread::id);
+            if(static_cast<size_t>(rec_end - rec) < fixed + sizeof(uint32_t))    return finish(false);
+            line.used_bytes = 0;
+            memcpy(line.buffer(), rec, fixed);
+            line.used_bytes += fixed;
+            rec += fixed;
+            const uint32_t site_id = BinaryEncoder::read<uint32_t>(rec);
+            const CallSite* site = site_id < sites.size() ? &sites[site_id] : &unknown;
+            line.encode<const CallSite*>(site);
+            if(site -> format() != nullptr){
+                // untagged, so the site's types say where each argument ends
+                const char* arg = rec;
+                for(uint8_t id : site_types[site_id]){
+                    const size_t left = rec_end - arg;
+                    const size_t n = id == BinaryEncoder::string_id ? strnlen(arg, left) + 1 : BinaryEncoder::type_size(id);
+                    if(n > left)    return finish(false);
+                    arg += n;
+                }
+                if(arg != rec_end)  return finish(false);
+                line.resize_buffer(rec_end - rec);
+                memcpy(line.buffer(), rec, rec_end - rec);
+                line.used_bytes += rec_end - rec;
+                line.format(text);
+                continue;
+            }
+
+            while(rec < rec_end){
+                const uint8_t file_id = static_cast<uint8_t>(*rec++);
+                if(file_id >= type_cnt || type_map[file_id] < 0)    return finish(false);
+                const uint8_t id = static_cast<uint8_t>(type_map[file_id]);
+                const size_t left = rec_end - rec;
+                if(id == BinaryEncoder::literal_id){
+                    if(left < sizeof(uint32_t)) return finish(false);
+                    line.encode<LogLine::string_literal_t>(literal(rec), id);
+                }else if(id == BinaryEncoder::string_id || id == BinaryEncoder::field_id){
+                    const size_t n = strnlen(rec, left);
+                    if(n == left)   return finish(false);   // no NUL before the record ends
+                    if(id == BinaryEncoder::string_id)  line.encode_string(rec, n);
+                    else    line.encode_field(rec, n);
+                    rec += n + 1;
+                }else{
+                    const size_t n = type_sizes[file_id];
+                    if(left < n)    return finish(false);
+                    line.resize_buffer(n + 1);
+                    char* b = line.buffer();
+                    *b = static_cast<char>(id);
+                    memcpy(b + 1, rec, n);
+                    line.used_bytes += n + 1;
+                    rec += n;
+                }
+            }
+            line.format(text);
+        }
+        return finish(true);
+    }
+}
+
+namespace slog{
+    bool decode_ring(const std::string& path, std::ostream& out){
+        ByteBuffer text;
+        bool valid = false;
+        ByteRingBuffer::recover(path, [&](LogLine& logline){
+            text.clear();
+            logline.format(text);
+            out.write(text.data(), text.size());
+            valid = true;
+        });
+        return valid;
+    }
+}
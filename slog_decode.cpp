@@ -0,0 +1,59 @@
+#include "include/slog.h"
+#include "include/lz.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+int main(int argc, char** argv){
+    // -r: the input is a Config::ring_file left behind by a crashed process
+    const bool ring = argc > 1 && strcmp(argv[1], "-r") == 0;
+    char** args = ring ? argv + 1 : argv;
+    const int count = ring ? argc - 1 : argc;
+    if(count < 2){
+        fprintf(stderr, "usage: %s <log.N.slog[.lz] | log.N.txt.lz> [out.txt]\n       %s -r <ring file> [out.txt]\n", argv[0], argv[0]);
+        return 2;
+    }
+    std::ifstream in(args[1], std::ios::binary);
+    if(!in){
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], args[1]);
+        return 2;
+    }
+    std::ofstream file;
+    if(count > 2)   file.open(args[2]);
+    std::ostream& out = count > 2 ? static_cast<std::ostream&>(file) : std::cout;
+    if(ring){
+        if(!slog::decode_ring(args[1], out)){
+            fprintf(stderr, "%s: %s is not a slog ring file or holds no records\n", argv[0], args[1]);
+            return 1;
+        }
+        return 0;
+    }
+    slog::LzFileHeader header;
+    if(in.read(reinterpret_cast<char*>(&header), sizeof(header)) && memcmp(header.magic, slog::lz_magic, sizeof(slog::lz_magic)) == 0){
+        // Config::compress_level: text layouts come out as they are, BINARY is decoded
+        std::string raw;
+        if(!slog::lz_read_file(args[1], raw)){
+            fprintf(stderr, "%s: %s is a compressed log of an unknown version\n", argv[0], args[1]);
+            return 1;
+        }
+        if(header.format != static_cast<uint8_t>(slog::OutputFormat::BINARY)){
+            out.write(raw.data(), raw.size());
+            return 0;
+        }
+        std::istringstream packed(raw);
+        if(!slog::decode_binary(packed, out)){
+            fprintf(stderr, "%s: %s is not a complete slog binary file\n", argv[0], args[1]);
+            return 1;
+        }
+        return 0;
+    }
+    in.clear();
+    in.seekg(0);
+    if(!slog::decode_binary(in, out)){
+        fprintf(stderr, "%s: %s is not a complete slog binary file\n", argv[0], args[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,498 @@
+#include "include/slog.h"
+#include "include/log_index.h"
+#include "include/lz.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// prints the lines of path.N.{txt,jsonl,logfmt}[.lz] that match a level, time window
+// and call site, reading only the blocks their path.N.idx says can match; see usage()
+
+namespace{
+    struct Query{
+        uint32_t levels = 0x1f;     // bit per LogSeverity
+        uint64_t from = 0;          // ns since epoch
+        uint64_t to = UINT64_MAX;
+        std::string site_file;      // base name, empty for any
+        uint32_t site_line = 0;
+        uint64_t site_key = 0;
+        std::string text;           // substring, empty for any
+    };
+
+    struct LogPath{
+        std::string path;
+        uint32_t index;
+        slog::OutputFormat format;
+        bool packed;    // .lz, Config::compress_level
+    };
+
+    // the fields of one line a query looks at; ts 0 when the layout cannot be read back
+    struct Parsed{
+        int level = -1;
+        uint64_t ts = 0;
+        const char* file = nullptr;
+        size_t file_len = 0;
+        uint32_t line = 0;
+    };
+
+    int parse_level(const char* s, size_t n){
+        for(int level = 0; level <= static_cast<int>(slog::LogSeverity::FATAL); level++){
+            const char* name = slog::level_to_string(static_cast<slog::LogSeverity>(level));
+            if(strlen(name) == n && strncasecmp(name, s, n) == 0)   return level;
+        }
+        return -1;
+    }
+
+    int parse_level_option(const char* s){
+        // --level: a level name or any start of one, warn and err included; the names start with distinct letters
+        const size_t n = strlen(s);
+        for(int level = 0; n != 0 && level <= static_cast<int>(slog::LogSeverity::FATAL); level++){
+            const char* name = slog::level_to_string(static_cast<slog::LogSeverity>(level));
+            if(n <= strlen(name) && strncasecmp(name, s, n) == 0)   return level;
+        }
+        return -1;
+    }
+
+    const char* find(const char* begin, const char* end, const char* needle){
+        const size_t n = strlen(needle);
+        for(const char* p = begin; p + n <= end; p++){
+            p = static_cast<const char*>(memchr(p, needle[0], end - p));
+            if(p == nullptr || p + n > end) return nullptr;
+            if(memcmp(p, needle, n) == 0)   return p;
+        }
+        return nullptr;
+    }
+
+    uint32_t parse_uint(const char*& p, const char* end, int max_digits = 10){
+        uint32_t value = 0;
+        for(int i = 0; i < max_digits && p < end && *p >= '0' && *p <= '9'; i++)  value = value * 10 + (*p++ - '0');
+        return value;
+    }
+
+    // 2024-03-09T15:45:07[.fff][+hh:mm], local time without an offset; 0 if it is not one
+    uint64_t parse_iso(const char* p, const char* end){
+        if(end - p < 19 || p[4] != '-' || p[7] != '-' || p[10] != 'T' || p[13] != ':' || p[16] != ':')  return 0;
+        // consecutive lines mostly share their second, and mktime is the slow part
+        thread_local char last_second[19];
+        thread_local time_t last_local = -1;
+        if(memcmp(last_second, p, sizeof(last_second)) != 0){
+            memcpy(last_second, p, sizeof(last_second));
+            last_local = -1;
+        }
+        std::tm tm{};
+        tm.tm_year = static_cast<int>(parse_uint(p, end, 4)) - 1900;
+        p++;
+        tm.tm_mon = static_cast<int>(parse_uint(p, end, 2)) - 1;
+        p++;
+        tm.tm_mday = static_cast<int>(parse_uint(p, end, 2));
+        p++;
+        tm.tm_hour = static_cast<int>(parse_uint(p, end, 2));
+        p++;
+        tm.tm_min = static_cast<int>(parse_uint(p, end, 2));
+        p++;
+        tm.tm_sec = static_cast<int>(parse_uint(p, end, 2));
+        uint64_t fraction = 0;
+        if(p < end && *p == '.'){
+            p++;
+            int digits = 0;
+            for(; p < end && *p >= '0' && *p <= '9'; p++, digits++){
+                if(digits < 9)  fraction = fraction * 10 + (*p - '0');
+            }
+            for(; digits < 9; digits++) fraction *= 10;
+        }
+        time_t seconds;
+        if(p < end && (*p == '+' || *p == '-') && end - p >= 6){
+            const int sign = *p == '-' ? -1 : 1;
+            p++;
+            const int hours = static_cast<int>(parse_uint(p, end, 2));
+            p++;
+            const int minutes = static_cast<int>(parse_uint(p, end, 2));
+            seconds = timegm(&tm) - sign * (hours * 3600 + minutes * 60);
+        }else{
+            if(last_local < 0){
+                tm.tm_isdst = -1;
+                last_local = mktime(&tm);
+            }
+            seconds = last_local;
+        }
+        return seconds < 0 ? 0 : static_cast<uint64_t>(seconds) * 1000000000 + fraction;
+    }
+
+    // [time[Level][thread][file:func:line] ...; COMPACT times are not read back
+    Parsed parse_text(const char* p, const char* end){
+        Parsed parsed;
+        if(p == end || *p != '[')   return parsed;
+        const char* tag = static_cast<const char*>(memchr(p + 1, '[', end - p - 1));
+        if(tag == nullptr)  return parsed;
+        const char* time_end = tag[-1] == ']' ? tag - 1 : tag;
+        parsed.ts = parse_iso(p + 1, time_end);
+        const char* close = static_cast<const char*>(memchr(tag, ']', end - tag));
+        if(close == nullptr)    return parsed;
+        parsed.level = parse_level(tag + 1, close - tag - 1);
+        const char* thread_end = close + 1 < end ? static_cast<const char*>(memchr(close + 1, ']', end - close - 1)) : nullptr;
+        if(thread_end == nullptr || thread_end + 1 >= end || thread_end[1] != '[')  return parsed;
+        const char* site = thread_end + 2;
+        const char* site_end = static_cast<const char*>(memchr(site, ']', end - site));
+        if(site_end == nullptr) return parsed;
+        const char* colon = static_cast<const char*>(memchr(site, ':', site_end - site));
+        const char* last = site_end;
+        while(last > site && last[-1] != ':')   last--;
+        if(colon == nullptr || last == site)    return parsed;
+        parsed.file = site;
+        parsed.file_len = colon - site;
+        parsed.line = parse_uint(last, site_end);
+        return parsed;
+    }
+
+    // the value after key in a JSON ("key":"value" or "key":value) or LOGFMT (key=value) line
+    bool field(const char* p, const char* end, const char* key, bool json, const char*& value, size_t& len){
+        const char* at = find(p, end, key);
+        if(at == nullptr)   return false;
+        value = at + strlen(key);
+        const bool quoted = value < end && *value == '"';
+        if(quoted)  value++;
+        const char* stop = value;
+        if(quoted)  while(stop < end && *stop != '"')   stop += *stop == '\\' ? 2 : 1;
+        else    while(stop < end && *stop != (json ? ',' : ' ') && *stop != '\n' && *stop != '}')  stop++;
+        len = std::min(stop, end) - value;
+        return true;
+    }
+
+    Parsed parse_structured(const char* p, const char* end, bool json){
+        Parsed parsed;
+        const char* value;
+        size_t len;
+        if(field(p, end, json ? "\"ts\":" : "ts=", json, value, len))   parsed.ts = parse_iso(value, value + len);
+        if(field(p, end, json ? "\"level\":" : " level=", json, value, len))    parsed.level = parse_level(value, len);
+        if(field(p, end, json ? "\"file\":" : " file=", json, value, len)){
+            parsed.file = value;
+            parsed.file_len = len;
+        }
+        if(field(p, end, json ? "\"line\":" : " line=", json, value, len))  parsed.line = parse_uint(value, value + len);
+        return parsed;
+    }
+
+    bool site_matches(const Parsed& parsed, const Query& query){
+        if(query.site_file.empty()) return true;
+        if(parsed.file == nullptr || parsed.line != query.site_line)    return false;
+        const char* name = parsed.file;
+        for(size_t i = 0; i < parsed.file_len; i++){
+            if(parsed.file[i] == '/')   name = parsed.file + i + 1;
+        }
+        const size_t name_len = parsed.file + parsed.file_len - name;
+        return name_len == query.site_file.size() && memcmp(name, query.site_file.data(), name_len) == 0;
+    }
+
+    // appends the matching lines of [begin, end) to out; check_time false when the whole range is in the window
+    void scan(const char* begin, const char* end, slog::OutputFormat format, const Query& query, bool check_time, std::string& out){
+        for(const char* p = begin; p < end;){
+            const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+            const char* line_end = nl != nullptr ? nl + 1 : end;
+            if(*p == '\0')  return;     // the zeroed tail of a preallocated or mapped file
+            const Parsed parsed = format == slog::OutputFormat::TEXT ? parse_text(p, line_end)
+                : parse_structured(p, line_end, format == slog::OutputFormat::JSON);
+            const bool match = parsed.level >= 0 && (query.levels & (1u << parsed.level)) != 0
+                && (!check_time || parsed.ts == 0 || (parsed.ts >= query.from && parsed.ts <= query.to))
+                && site_matches(parsed, query)
+                && (query.text.empty() || find(p, line_end, query.text.c_str()) != nullptr);
+            if(match){
+                out.append(p, line_end - p);
+                if(nl == nullptr)   out.push_back('\n');
+            }
+            p = line_end;
+        }
+    }
+
+    class Mapped{
+    public:
+        explicit Mapped(const std::string& path){
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0)  return;
+            struct stat st;
+            if(::fstat(fd, &st) == 0 && st.st_size > 0){
+                void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(map != MAP_FAILED){
+                    data = static_cast<const char*>(map);
+                    size = static_cast<size_t>(st.st_size);
+                }
+            }
+            ::close(fd);
+        }
+
+        ~Mapped(){
+            if(data != nullptr) ::munmap(const_cast<char*>(data), size);
+        }
+
+        Mapped(const Mapped&) = delete;
+        Mapped& operator=(const Mapped&) = delete;
+
+        const char* data = nullptr;
+        size_t size = 0;
+    };
+
+    struct FileResult{
+        std::string lines;
+        uint64_t blocks = 0;
+        uint64_t blocks_read = 0;
+        uint64_t bytes_read = 0;
+    };
+
+    // the log as written: the mapped file itself, or the blocks of a .lz one
+    // unpacked as ranges reach them, the last one kept for the next range
+    class LogBytes{
+    public:
+        LogBytes(const Mapped& file, bool packed) : file(file), packed(packed){
+            if(!packed){
+                raw_size = file.size;
+                return;
+            }
+            slog::LzFileHeader header;
+            if(file.size < sizeof(header))  return;
+            memcpy(&header, file.data, sizeof(header));
+            if(memcmp(header.magic, slog::lz_magic, sizeof(slog::lz_magic)) != 0 || header.version != slog::lz_version)  return;
+            for(size_t pos = sizeof(header); pos + sizeof(slog::LzBlock) <= file.size;){
+                slog::LzBlock block;
+                memcpy(&block, file.data + pos, sizeof(block));
+                pos += sizeof(block);
+                const size_t bytes = block.packed_bytes & ~slog::lz_stored;
+                if(block.raw_bytes == 0 || bytes > file.size - pos || block.raw_offset != raw_size)    break;   // torn by a crash
+                blocks.push_back(block);
+                payloads.push_back(pos);
+                raw_size += block.raw_bytes;
+                pos += bytes;
+            }
+        }
+
+        uint64_t size() const noexcept{return raw_size;}
+
+        // f(begin, end) over the pieces of [from, to), which ends at or before size()
+        template<typename F>
+        void each(uint64_t from, uint64_t to, F f){
+            if(!packed){
+                f(file.data + from, file.data + to);
+                return;
+            }
+            auto it = std::upper_bound(blocks.begin(), blocks.end(), from,
+                [](uint64_t offset, const slog::LzBlock& block){return offset < block.raw_offset;});
+            for(size_t i = it - blocks.begin() - 1; i < blocks.size() && blocks[i].raw_offset < to; i++){
+                const slog::LzBlock& block = blocks[i];
+                if(i != unpacked){
+                    raw.resize(block.raw_bytes);
+                    if(!slog::lz_unpack(block, file.data + payloads[i], &raw[0]))    return;
+                    unpacked = i;
+                }
+                const uint64_t begin = std::max(from, block.raw_offset) - block.raw_offset;
+                const uint64_t end = std::min<uint64_t>(to, block.raw_offset + block.raw_bytes) - block.raw_offset;
+                f(raw.data() + begin, raw.data() + end);
+            }
+        }
+
+    private:
+        const Mapped& file;
+        const bool packed;
+        uint64_t raw_size = 0;
+        std::vector<slog::LzBlock>blocks;
+        std::vector<size_t>payloads;
+        std::string raw;
+        size_t unpacked = SIZE_MAX;
+    };
+
+    void query_file(const LogPath& log, const std::string& prefix, const Query& query, FileResult& result){
+        const Mapped file(log.path);
+        if(file.data == nullptr)    return;
+        LogBytes bytes(file, log.packed);
+        const Mapped index(prefix + "." + std::to_string(log.index) + ".idx");
+        uint64_t indexed = 0;   // the log is scanned from here to its end
+        auto scan_range = [&](uint64_t begin, uint64_t end, bool check_time){
+            result.bytes_read += end - begin;
+            bytes.each(begin, end, [&](const char* from, const char* to){
+                scan(from, to, log.format, query, check_time, result.lines);
+            });
+        };
+        if(index.size >= sizeof(slog::IndexHeader) && memcmp(index.data, slog::index_magic, sizeof(slog::index_magic)) == 0){
+            slog::IndexHeader header;
+            memcpy(&header, index.data, sizeof(header));
+            if(header.version == slog::index_version){
+                const size_t count = (index.size - sizeof(header)) / sizeof(slog::IndexBlock);
+                for(size_t i = 0; i < count; i++){
+                    slog::IndexBlock block;
+                    memcpy(&block, index.data + sizeof(header) + i * sizeof(block), sizeof(block));
+                    if(block.offset + block.bytes > bytes.size())   break;  // blocks the process never got to disk
+                    result.blocks++;
+                    indexed = block.offset + block.bytes;
+                    if((block.levels & query.levels) == 0 || block.max_ts < query.from || block.min_ts > query.to)  continue;
+                    if(!query.site_file.empty() && !slog::index_bloom_test(block.sites, query.site_key))    continue;
+                    result.blocks_read++;
+                    const bool inside = block.min_ts >= query.from && block.max_ts <= query.to;
+                    scan_range(block.offset, block.offset + block.bytes, !inside);
+                }
+            }
+        }
+        if(indexed < bytes.size())  scan_range(indexed, bytes.size(), true);
+    }
+
+    // path.N.txt, .jsonl and .logfmt files of prefix, .lz or not, in roll order
+    std::vector<LogPath> list_logs(const std::string& prefix){
+        const std::filesystem::path base(prefix);
+        const std::string dir = base.has_parent_path() ? base.parent_path().string() : ".";
+        const std::string name = base.filename().string() + ".";
+        std::vector<LogPath> logs;
+        std::error_code ec;
+        for(const auto& entry : std::filesystem::directory_iterator(dir, ec)){
+            const std::string file = entry.path().filename().string();
+            if(file.compare(0, name.size(), name) != 0) continue;
+            const char* p = file.c_str() + name.size();
+            char* number_end;
+            const unsigned long index = strtoul(p, &number_end, 10);
+            if(number_end == p) continue;
+            std::string extension = number_end;
+            const bool packed = extension.size() > 3 && extension.compare(extension.size() - 3, 3, ".lz") == 0;
+            if(packed)  extension.resize(extension.size() - 3);
+            slog::OutputFormat format;
+            if(extension == ".txt") format = slog::OutputFormat::TEXT;
+            else if(extension == ".jsonl")  format = slog::OutputFormat::JSON;
+            else if(extension == ".logfmt") format = slog::OutputFormat::LOGFMT;
+            else    continue;
+            logs.push_back(LogPath{entry.path().string(), static_cast<uint32_t>(index), format, packed});
+        }
+        // a file caught between recompression's rename and unlink is there twice, the .lz copy is kept
+        std::sort(logs.begin(), logs.end(), [](const LogPath& a, const LogPath& b){
+            return a.index != b.index ? a.index < b.index : a.packed > b.packed;
+        });
+        logs.erase(std::unique(logs.begin(), logs.end(), [](const LogPath& a, const LogPath& b){return a.index == b.index;}), logs.end());
+        return logs;
+    }
+
+    // 90s, 10m, 2h, 1d
+    bool parse_duration(const char* s, uint64_t& ns){
+        char* end;
+        const double value = strtod(s, &end);
+        if(end == s || value < 0)   return false;
+        const double unit = *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 0;
+        if(unit == 0 || end[1] != '\0') return false;
+        ns = static_cast<uint64_t>(value * unit * 1e9);
+        return true;
+    }
+
+    // seconds since the epoch, or an ISO8601 time (local without an offset)
+    bool parse_time(const char* s, uint64_t& ns){
+        char* end;
+        const unsigned long long seconds = strtoull(s, &end, 10);
+        if(end != s && *end == '\0'){
+            ns = seconds * 1000000000;
+            return true;
+        }
+        ns = parse_iso(s, s + strlen(s));
+        return ns != 0;
+    }
+
+    void usage(const char* argv0){
+        fprintf(stderr, "usage: %s [--level L] [--last 10m | --from T] [--to T] [--site file.cpp:42] [--grep TEXT] [--threads N] [--stats] DIR/NAME\n"
+            "  prints the lines of DIR/NAME.N.{txt,jsonl,logfmt}[.lz] at level L or above, L one of\n"
+            "  debug, info, warning (warn), error (err), fatal or the start of one, in any case,\n"
+            "  in the time window, from the call site, containing TEXT. T is seconds since the epoch\n"
+            "  or 2024-03-09T15:45:07[+01:00]. With a NAME.N.idx beside a file only its matching\n"
+            "  blocks are read; COMPACT TEXT times are only filtered per block\n", argv0);
+    }
+}
+
+int main(int argc, char** argv){
+    Query query;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool stats = false;
+    const char* prefix = nullptr;
+    for(int i = 1; i < argc; i++){
+        const bool has_value = i + 1 < argc;
+        if(strcmp(argv[i], "--level") == 0 && has_value){
+            const char* name = argv[++i];
+            const int level = parse_level_option(name);
+            if(level < 0){
+                fprintf(stderr, "%s: unknown level %s\n", argv[0], name);
+                return 2;
+            }
+            query.levels = 0x1f & ~((1u << level) - 1);
+        }else if(strcmp(argv[i], "--last") == 0 && has_value){
+            uint64_t window;
+            if(!parse_duration(argv[++i], window)){
+                fprintf(stderr, "%s: bad duration %s\n", argv[0], argv[i]);
+                return 2;
+            }
+            const uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            query.from = now > window ? now - window : 0;
+        }else if((strcmp(argv[i], "--from") == 0 || strcmp(argv[i], "--to") == 0) && has_value){
+            uint64_t& bound = argv[i][2] == 'f' ? query.from : query.to;
+            if(!parse_time(argv[++i], bound)){
+                fprintf(stderr, "%s: bad time %s\n", argv[0], argv[i]);
+                return 2;
+            }
+        }else if(strcmp(argv[i], "--site") == 0 && has_value){
+            const std::string site = argv[++i];
+            const size_t colon = site.rfind(':');
+            if(colon == std::string::npos || colon == 0){
+                fprintf(stderr, "%s: --site wants file:line\n", argv[0]);
+                return 2;
+            }
+            const size_t slash = site.rfind('/', colon);
+            query.site_file = site.substr(slash == std::string::npos ? 0 : slash + 1, colon - (slash == std::string::npos ? 0 : slash + 1));
+            query.site_line = static_cast<uint32_t>(strtoul(site.c_str() + colon + 1, nullptr, 10));
+            query.site_key = slog::index_site_key(query.site_file.c_str(), query.site_line);
+        }else if(strcmp(argv[i], "--grep") == 0 && has_value){
+            query.text = argv[++i];
+        }else if(strcmp(argv[i], "--threads") == 0 && has_value){
+            threads = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        }else if(strcmp(argv[i], "--stats") == 0){
+            stats = true;
+        }else if(argv[i][0] != '-' && prefix == nullptr){
+            prefix = argv[i];
+        }else{
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if(prefix == nullptr){
+        usage(argv[0]);
+        return 2;
+    }
+
+    const std::vector<LogPath> logs = list_logs(prefix);
+    if(logs.empty()){
+        fprintf(stderr, "%s: no log files for %s\n", argv[0], prefix);
+        return 1;
+    }
+    // one file per task, printed in roll order once every file is done
+    const auto begin = std::chrono::steady_clock::now();
+    std::vector<FileResult> results(logs.size());
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for(unsigned t = 0; t < std::min<size_t>(threads, logs.size()); t++){
+        workers.emplace_back([&]{
+            for(size_t i; (i = next.fetch_add(1)) < logs.size();)   query_file(logs[i], prefix, query, results[i]);
+        });
+    }
+    for(std::thread& worker : workers)  worker.join();
+    uint64_t blocks = 0, blocks_read = 0, bytes_read = 0;
+    for(const FileResult& result : results){
+        fwrite(result.lines.data(), 1, result.lines.size(), stdout);
+        blocks += result.blocks;
+        blocks_read += result.blocks_read;
+        bytes_read += result.bytes_read;
+    }
+    if(stats){
+        fprintf(stderr, "%zu files, %lu of %lu indexed blocks read, %lu bytes scanned in %.1f ms\n",
+            logs.size(), (unsigned long)blocks_read, (unsigned long)blocks, (unsigned long)bytes_read,
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
+    }
+    return 0;
+}
@@ -1,43 +1,233 @@
 #include "include/slog.h"
-#include <iostream>
+#include "include/lz.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
-#include <ctime>
-
-void benchmark(){
-    const char* const str = "benchmark";
-    auto begin = std::chrono::high_resolution_clock::now();
-    for(int i = 0; i < 100000; i++){
-        LOG_INFO << "Logging-" << i << "-double-" << -99.876 << "-uint64-" << (uint64_t)i;
-    }
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
-    long int avg = duration.count() / 100000;
-    printf("Avg: %ld\n", avg);
-    printf("Total: %ld\n", duration.count());
-}
+#include <sys/wait.h>
+#include <unistd.h>
+
+// behaviour checks, exit status 1 if one fails; "./test abort" then ends in a
+// failed CHECK to show the fatal path. Benchmarks live in bench.cpp
+
+namespace{
+    int failures = 0;
+
+    void expect(bool ok, const char* what){
+        if(ok)  return;
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+
+    // prefix.1.ext, prefix.2.ext, ... up to the first one missing, appended
+    std::string read_files(const std::string& prefix, const char* ext){
+        std::string text;
+        for(int i = 1;; i++){
+            std::ifstream in(prefix + "." + std::to_string(i) + ext);
+            if(!in) return text;
+            text.append(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+    }
+
+    uint64_t count_lines(const std::string& prefix, const char* ext){
+        const std::string text = read_files(prefix, ext);
+        return std::count(text.begin(), text.end(), '\n');
+    }
+
+    slog::Config config_for(const std::string& dir, const char* name){
+        slog::Config config;
+        config.dir = dir;
+        config.name = name;
+        config.roll_size = 1;
+        return config;
+    }
+
+    void ring_recovers_after_kill(const std::string& dir){
+        // a child logs into a file-backed ring and is killed before its consumer catches up;
+        // the next logger on that ring writes what the child committed. Forks before any thread starts
+        const int records = 20000;
+        slog::Config config = config_for(dir, "killed");
+        config.queue_mode = slog::QueueMode::BYTE_RING;
+        config.byte_ring_kb = 4096;
+        config.ring_file = dir + "ring";
+        const pid_t child = fork();
+        if(child == 0){
+            slog::Channel& ring = slog::channel("killed");
+            ring.init(config);
+            for(int i = 0; i < records; i++)    SLOG_TO(ring, slog::LogSeverity::INFO) << "ring " << i << " end";
+            kill(getpid(), SIGKILL);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        expect(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL, "ring child killed");
+
+        config.name = "recovered";
+        slog::Channel& ring = slog::channel("recovered");
+        ring.init(config);
+        ring.flush();
+        // released after the flush, so a record may be written twice but never lost
+        const std::string text = read_files(dir + "killed", ".txt") + read_files(dir + "recovered", ".txt");
+        std::vector<bool>seen(records);
+        for(size_t at = 0; (at = text.find("ring ", at)) != std::string::npos; at++){
+            const long i = strtol(text.c_str() + at + 5, nullptr, 10);
+            if(i >= 0 && i < records)   seen[i] = true;
+        }
+        expect(std::count(seen.begin(), seen.end(), true) == records, "ring recovery keeps every committed record");
+    }
+
+    void lz_round_trip(){
+        std::string log_text;
+        for(int i = 0; log_text.size() < (1 << 18); i++){
+            log_text += "2026-10-17 12:00:00.123456 INFO test.cpp:42 request " + std::to_string(i * 7919) + " done\n";
+        }
+        std::string noise(1 << 16, '\0');
+        std::mt19937 random(42);
+        for(char& c : noise)    c = static_cast<char>(random());
+        for(const std::string* raw : {&log_text, &noise}){
+            for(int level : {1, 5, 9}){
+                std::vector<char>packed(slog::lz_bound(raw -> size()));
+                const size_t bytes = slog::lz_compress(raw -> data(), raw -> size(), packed.data(), level);
+                std::string out(raw -> size(), '\0');
+                expect(bytes <= packed.size() && slog::lz_decompress(packed.data(), bytes, &out[0], out.size()) && out == *raw,
+                    "lz round trip");
+                if(bytes > 1)   expect(!slog::lz_decompress(packed.data(), bytes - 1, &out[0], out.size()), "lz rejects a cut payload");
+            }
+        }
+    }
 
-template<typename F>
-void create_thread(F&& f, int cnt){
-    std::vector<std::thread>threads;
-    for(int i = 0; i < cnt; i++){
-        threads.emplace_back(f);
+    void lz_file_reads_back(const std::string& dir){
+        const int records = 50000;
+        slog::Config config = config_for(dir, "lz");
+        config.compress_level = 1;
+        slog::Channel& lz = slog::channel("lz");
+        lz.init(config);
+        for(int i = 0; i < records; i++)    SLOGF_TO(lz, slog::LogSeverity::INFO, "lz {} of {}", i, records);
+        lz.flush();
+        std::string text;
+        for(int i = 1;; i++){
+            std::string part;
+            if(!slog::lz_read_file(dir + "lz." + std::to_string(i) + ".txt.lz", part))  break;
+            text += part;
+        }
+        expect(std::count(text.begin(), text.end(), '\n') == records, "compressed files read back every line");
+        expect(text.find("lz 49999 of 50000") != std::string::npos, "compressed files keep the text");
     }
-    for(int i = 0; i < cnt; i++){
-        threads[i].join();
+
+    void binary_decodes(const std::string& dir){
+        const int records = 1000;
+        slog::Config config = config_for(dir, "binary");
+        config.format = slog::OutputFormat::BINARY;
+        slog::Channel& binary = slog::channel("binary");
+        binary.init(config);
+        for(int i = 0; i < records; i++){
+            if(i % 2 == 0)  SLOGF_TO(binary, slog::LogSeverity::WARN, "binary {} {} {}", i, 2.5, "str");
+            else            SLOG_TO(binary, slog::LogSeverity::INFO) << "stream " << i << ' ' << std::string("text");
+        }
+        binary.flush();
+        std::ifstream file(dir + "binary.1.slog", std::ios::binary);
+        const std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        std::istringstream in(bytes);
+        std::ostringstream out;
+        expect(slog::decode_binary(in, out), "binary file decodes");
+        const std::string text = out.str();
+        expect(std::count(text.begin(), text.end(), '\n') == records, "binary decodes every record");
+        expect(text.find("binary 998 2.5 str") != std::string::npos && text.find("stream 999 text") != std::string::npos,
+            "binary decodes the arguments");
+        // every cut of the file stops cleanly instead of reading past it
+        for(size_t n = 0; n < bytes.size(); n += n < 512 ? 1 : 97){
+            std::istringstream cut(bytes.substr(0, n));
+            std::ostringstream sink;
+            slog::decode_binary(cut, sink);
+        }
+    }
+
+    void byte_ring_keeps_large_records(const std::string& dir){
+        // records over a quarter of the ring go out of band instead of being dropped
+        const int records = 2000;
+        slog::Config config = config_for(dir, "large");
+        config.queue_mode = slog::QueueMode::BYTE_RING;
+        config.byte_ring_kb = 64;
+        slog::Channel& large = slog::channel("large");
+        large.init(config);
+        const std::string payload(40 << 10, 'x');
+        for(int i = 0; i < records; i++){
+            if(i % 10 == 0) SLOG_TO(large, slog::LogSeverity::INFO) << "large " << i << ' ' << payload;
+            else            SLOG_TO(large, slog::LogSeverity::INFO) << "small " << i;
+        }
+        large.flush();
+        expect(large.dropped() == 0 && count_lines(dir + "large", ".txt") == records, "byte ring keeps records over a quarter of it");
+    }
+
+    void limiters_admit(const std::string& dir){
+        slog::init(config_for(dir, "limit"));
+        for(int i = 0; i < 100; i++)    LOG_EVERY_N(slog::LogSeverity::INFO, 10) << "every " << i;
+        for(int i = 0; i < 100; i++)    LOG_FIRST_N(slog::LogSeverity::INFO, 3) << "first " << i;
+        slog::flush();
+        const std::string text = read_files(dir + "limit", ".txt");
+        size_t every = 0;
+        size_t first = 0;
+        for(size_t at = 0; (at = text.find("every ", at)) != std::string::npos; at++)   every++;
+        for(size_t at = 0; (at = text.find("first ", at)) != std::string::npos; at++)   first++;
+        expect(every == 10 && text.find("every 90") != std::string::npos && text.find("every 91") == std::string::npos,
+            "LOG_EVERY_N admits the 1st, N+1th ... line");
+        expect(first == 3 && text.find("first 2") != std::string::npos, "LOG_FIRST_N admits the first N lines");
+    }
+
+    void reinit_keeps_records(const std::string& dir){
+        // init() again with the same files while threads log: every record written reaches the files
+        const slog::Config config = config_for(dir, "reinit");
+        const uint64_t before = slog::stats().written;
+        slog::init(config);
+        std::atomic<bool>stop{false};
+        std::vector<std::thread>threads;
+        for(int t = 0; t < 4; t++){
+            threads.emplace_back([&stop]{
+                for(uint64_t i = 0; !stop.load(std::memory_order_relaxed); i++) LOG_INFO << "reinit " << i;
+            });
+        }
+        for(int i = 0; i < 5; i++){
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            slog::init(config);
+        }
+        stop.store(true);
+        for(std::thread& thread : threads)  thread.join();
+        LOG_INFO << "inside " << (slog::init(config), 1);     // the statement still holds the replaced logger
+        slog::flush();
+        expect(count_lines(dir + "reinit", ".txt") == slog::stats().written - before, "re-init keeps every written record");
     }
 }
 
-int main(){
+int main(int argc, char** argv){
+    char dir[] = "/tmp/slog_test.XXXXXX";
+    if(mkdtemp(dir) == nullptr) return 1;
+    const std::string test_dir = std::string(dir) + "/";
+    ring_recovers_after_kill(test_dir);
+    lz_round_trip();
+    lz_file_reads_back(test_dir);
+    binary_decodes(test_dir);
+    byte_ring_keeps_large_records(test_dir);
+    limiters_admit(test_dir);
+    reinit_keeps_records(test_dir);
+    if(failures != 0)   return 1;
+    printf("all checks passed, logs in %s\n", dir);
+    if(argc < 2 || strcmp(argv[1], "abort") != 0)   return 0;
+
     slog::init("/tmp/log/", "log", 8);
-    for(auto threads:{1,2,3}){
-        create_thread(benchmark, threads);
-    }
 
     LOG_INFO << "HELLO";
     int a=1;
     int b=2;
+    SLOGF(slog::LogSeverity::INFO, "a={} b={}", a, b);
     CHECK_EQ_F(1,2);
 
     return 0;
-}
\ No newline at end of file
+}